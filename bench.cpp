@@ -0,0 +1,240 @@
+/*******************************************************************************
+ * SparseMultiVec - A weird container.
+ * Version: 0.0.2
+ * https://github.com/dbralir/sparse-multi-vec
+ *
+ * Copyright (c) 2013 Jeramy Harrison <dbralir@gmail.com>
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *  3. This notice may not be removed or altered from any source distribution.
+ *
+ ******************************************************************************/
+
+// Rough timings for the column algorithms.
+// Build with optimizations, e.g. g++ -std=c++11 -O2 -pthread bench.cpp
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "sparsemultivec.hpp"
+
+using namespace std;
+
+const int rows = 1 << 22;
+
+template <typename F>
+double millis(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void report(const string& what, double ms)
+{
+    cout << what << "\t" << ms << " ms" << endl;
+}
+
+template <typename Table>
+void columnOps(const string& name, Table& table)
+{
+    long long byRow = 0;
+    long long byColumn = 0;
+    
+    report(name + " rows sum", millis([&]
+    {
+        for (auto&& r : table)
+        {
+            if (get<0>(r)) byRow += *get<0>(r);
+        }
+    }));
+    
+    report(name + " reduce", millis([&]
+    {
+        byColumn = table.template reduce<0>(0LL, plus<long long>{});
+    }));
+    
+    if (byRow != byColumn) cout << name << " reduce MISMATCH" << endl;
+    
+    int countRow = 0;
+    int countColumn = 0;
+    auto odd = [](int v){ return v % 2 != 0; };
+    
+    report(name + " rows count", millis([&]
+    {
+        for (auto&& r : table)
+        {
+            if (get<0>(r) && odd(*get<0>(r))) ++countRow;
+        }
+    }));
+    
+    report(name + " count_if", millis([&]
+    {
+        countColumn = table.template count_if<0>(odd);
+    }));
+    
+    if (countRow != countColumn) cout << name << " count_if MISMATCH" << endl;
+    
+    // Each pass adds one, so after both every value is up by two.
+    report(name + " rows add", millis([&]
+    {
+        for (auto&& r : table)
+        {
+            if (get<0>(r)) *get<0>(r) += 1;
+        }
+    }));
+    
+    report(name + " transform", millis([&]
+    {
+        table.template transform<0>([](int v){ return v + 1; });
+    }));
+    
+    if (table.template reduce<0>(0LL, plus<long long>{}) != byRow + 2LL * (table.size() - table.template column<0>().null_count()))
+    {
+        cout << name << " transform MISMATCH" << endl;
+    }
+}
+
+void columnAlgorithms()
+{
+    mt19937 rng{42};
+    uniform_int_distribution<int> run{1, 16};
+    
+    SparseMultiVec<int, float> sparse;
+    HybridSparseMultiVec<int, float> dense;
+    
+    for (int i = 0; i < rows; )
+    {
+        for (int n = run(rng); n > 0 && i < rows; --n, ++i) sparse.push_back(i, 0.5f);
+        for (int n = run(rng); n > 0 && i < rows; --n, ++i) sparse.push_back(nullptr, nullptr);
+    }
+    
+    for (int i = 0; i < rows; ++i) dense.push_back(i, 0.5f);
+    
+    columnOps("sparse", sparse);
+    columnOps("hybrid", dense);
+}
+
+template <typename Table>
+bool sameRows(Table& a, Table& b)
+{
+    if (a.size() != b.size()) return false;
+    
+    auto j = begin(b);
+    for (auto&& r : a)
+    {
+        auto s = *j;
+        ++j;
+        
+        auto a0 = get<0>(r), b0 = get<0>(s);
+        auto a1 = get<1>(r), b1 = get<1>(s);
+        if (bool(a0) != bool(b0) || (a0 && *a0 != *b0)) return false;
+        if (bool(a1) != bool(b1) || (a1 && *a1 != *b1)) return false;
+    }
+    return true;
+}
+
+// Ships a tick's worth of changes from one table to a replica
+// as a delta, and checks that the replica ends up the same.
+void deltas()
+{
+    using Table = SparseMultiVec<int, float>;
+    
+    mt19937 rng{7};
+    uniform_int_distribution<int> run{1, 16};
+    uniform_int_distribution<int> percent{0, 99};
+    
+    // About 1% of the rows change between the two,
+    // and a few new rows come in.
+    Table prev;
+    Table next;
+    int changed = 0;
+    
+    for (int i = 0; i < rows; )
+    {
+        auto solid = run(rng);
+        auto null = run(rng);
+        
+        for (int n = 0; n < solid + null && i < rows; ++n, ++i)
+        {
+            if (n < solid) prev.push_back(i, nullptr);
+            else prev.push_back(nullptr, float(i));
+            
+            auto flip = (percent(rng) == 0);
+            changed += flip;
+            if ((n < solid) != flip) next.push_back(flip? -i : i, nullptr);
+            else next.push_back(nullptr, float(i));
+        }
+    }
+    for (int i = 0; i < 1000; ++i) next.push_back(i, float(i));
+    
+    Table::delta_type delta;
+    Table replica = prev;
+    
+    report("diff", millis([&]{ delta = Table::diff(prev, next); }));
+    report("apply", millis([&]{ replica.apply(delta); }));
+    
+    cout << "rows changed	" << changed << endl;
+    cout << "edits	" << get<0>(delta).edits.size() + get<1>(delta).edits.size() << endl;
+    cout << "values	" << get<0>(delta).values.size() + get<1>(delta).values.size() << endl;
+    
+    if (!sameRows(replica, next)) cout << "delta MISMATCH" << endl;
+}
+
+// Splits a table in half and glues it back together a few times.
+// Trivial items move over in bulk; strings go one by one.
+template <typename Table, typename F, typename G>
+void splitAppend(const string& name, F first, G second)
+{
+    Table table;
+    for (int i = 0; i < rows; ++i)
+    {
+        if (i % 4 == 3) table.push_back(nullptr, nullptr);
+        else table.push_back(first(i), second(i));
+    }
+    
+    report(name + " split/append", millis([&]
+    {
+        for (int i = 1; i < 8; ++i)
+        {
+            auto back = table.split_at(rows * i / 8);
+            table.append(move(back));
+        }
+    }));
+    
+    if (table.size() != rows || !table.valid()) cout << name << " MISMATCH" << endl;
+}
+
+void relocation()
+{
+    auto str = [](int i){ return to_string(i); };
+    splitAppend<SparseMultiVec<int, float>>("int/float", [](int i){ return i; }, [](int i){ return float(i); });
+    splitAppend<SparseMultiVec<string, string>>("string", str, str);
+}
+
+int main()
+{
+    columnAlgorithms();
+    deltas();
+    relocation();
+    
+    return 0;
+}
@@ -123,14 +123,14 @@ int main()
     
     wreckIt(test);
     
+    test.transform<0>([](int i){ return i + 5; });
+    
     Counter<int> id;
     
     cout << "\tint\tfloat\tstring" << endl;
     
     for (auto&& i : test)
     {
-        if (std::get<0>(i)) *std::get<0>(i) += 5;
-        
         cout << int(id) << "\t";
         
         if (std::get<0>(i)) cout << *std::get<0>(i) << "\t";
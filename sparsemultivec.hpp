@@ -28,25 +28,276 @@
 #ifndef SPARSE_MULTI_VEC_HPP
 #define SPARSE_MULTI_VEC_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <vector>
 #include <iterator>
+#include <limits>
 
-template <template <typename> class Container, typename T>
+// Members that modify a std::array can only be constexpr from C++17 on.
+#if __cplusplus >= 201703L
+#define SPARSE_MULTI_VEC_CONSTEXPR constexpr
+#else
+#define SPARSE_MULTI_VEC_CONSTEXPR
+#endif
+
+// Instrumentation policies for SparseContainer.
+// NoInstrumentation compiles away entirely.
+struct NoInstrumentation
+{
+    static constexpr bool enabled = false;
+    
+    SPARSE_MULTI_VEC_CONSTEXPR void pushSolid(int) {}
+    SPARSE_MULTI_VEC_CONSTEXPR void pushNull() {}
+    SPARSE_MULTI_VEC_CONSTEXPR void reallocate() {}
+    SPARSE_MULTI_VEC_CONSTEXPR void eraseMoved(std::size_t) {}
+    SPARSE_MULTI_VEC_CONSTEXPR void stepSolid() {}
+    SPARSE_MULTI_VEC_CONSTEXPR void stepGap() {}
+};
+
+struct CountingInstrumentation
+{
+    static constexpr bool enabled = true;
+    
+    // Null runs are recorded when the solid that ends them is pushed.
+    // Bucket i counts runs of length [2^i, 2^(i+1)).
+    void pushSolid(int run)
+    {
+        ++solidPushes;
+        if (run > 0)
+        {
+            int bucket = 0;
+            while (run >>= 1) ++bucket;
+            ++runLengths[bucket];
+        }
+    }
+    
+    void pushNull() { ++nullPushes; }
+    void reallocate() { ++reallocations; }
+    void eraseMoved(std::size_t bytes) { ++erasures; bytesMoved += bytes; }
+    void stepSolid() { ++solidSteps; }
+    void stepGap() { ++gapSteps; }
+    
+    std::uint64_t solidPushes   = 0;
+    std::uint64_t nullPushes    = 0;
+    std::uint64_t reallocations = 0;
+    std::uint64_t erasures      = 0;
+    std::uint64_t bytesMoved    = 0;
+    std::uint64_t solidSteps    = 0;
+    std::uint64_t gapSteps      = 0;
+    std::uint64_t runLengths[32] = {};
+};
+
+// Storage statistics for a SparseContainer, or the sum over a MultiContainer.
+struct SparseStats
+{
+    int solids;
+    int nulls;
+    int runs;
+    std::size_t bytes;
+    
+    SparseStats& operator+=(const SparseStats& in)
+    {
+        solids += in.solids;
+        nulls  += in.nulls;
+        runs   += in.runs;
+        bytes  += in.bytes;
+        return *this;
+    }
+};
+
+// The edits that turn one SparseContainer into another, row by row.
+// Keep and Null edits are whole runs, and only Set edits carry values,
+// so a delta between two nearby versions is about as big as what changed.
+template <typename T>
+struct SparseDelta
+{
+    struct Edit
+    {
+        enum Kind { Keep, Null, Set };
+        
+        Kind kind;
+        int  count;
+    };
+    
+    int from;
+    int to;
+    std::vector<Edit> edits;
+    std::vector<T> values;
+    
+    void add(typename Edit::Kind kind, int count)
+    {
+        if (!edits.empty() && edits.back().kind == kind) edits.back().count += count;
+        else edits.push_back({kind, count});
+    }
+};
+
+// One column of input for SparseContainer::from_column:
+// a dense array of values and a byte per value, nonzero where it is present.
+template <typename T>
+struct ColumnInput
+{
+    const T* values;
+    const std::uint8_t* mask;
+};
+
+// A column laid out the way Arrow lays out fixed-width types:
+// a validity bitmap, with bit i (least significant first) set if row i is
+// present, and a slot for every row, unspecified where the row is null.
+// The slots are either owned, or borrowed straight from the column
+// they came from, in which case they are only good until it is modified.
+template <typename T>
+struct ColumnBuffers
+{
+    int length;
+    int null_count;
+    std::vector<std::uint8_t> validity;
+    const T* borrowed;
+    std::vector<T> owned;
+    
+    const T* values() const
+    {
+        return borrowed? borrowed : owned.data();
+    }
+};
+
+namespace detailSparseContainer
+{
+    template <typename C>
+    auto contiguous(const C& c, int) -> decltype(c.data())
+    {
+        return c.data();
+    }
+    
+    template <typename C>
+    const typename C::value_type* contiguous(const C&, long)
+    {
+        return nullptr;
+    }
+    
+    // True if any byte of w is zero.
+    inline bool hasZeroByte(std::uint64_t w)
+    {
+        return ((w - 0x0101010101010101ull) & ~w & 0x8080808080808080ull) != 0;
+    }
+    
+    template <typename C>
+    SPARSE_MULTI_VEC_CONSTEXPR auto capacity(const C& c, int) -> decltype(c.capacity())
+    {
+        return c.capacity();
+    }
+    
+    template <typename C>
+    SPARSE_MULTI_VEC_CONSTEXPR std::size_t capacity(const C&, long)
+    {
+        return 0;
+    }
+    
+    // Elements' worth of storage kept outside the container object itself.
+    // Inline storage is already part of sizeof, so it counts as none.
+    template <typename C>
+    auto heapCapacity(const C& c, int) -> decltype(c.is_inline(), std::size_t{})
+    {
+        return c.is_inline()? 0 : c.capacity();
+    }
+    
+    template <typename C>
+    std::size_t heapCapacity(const C& c, long)
+    {
+        return std::max<std::size_t>(capacity(c, 0), c.size());
+    }
+    
+    template <typename C>
+    auto reserve(C& c, std::size_t n, int) -> decltype(c.reserve(n))
+    {
+        return c.reserve(n);
+    }
+    
+    template <typename C>
+    void reserve(C&, std::size_t, long)
+    {}
+    
+    // Hints that the n elements starting at it are about to be read.
+    template <typename It>
+    void prefetch(It it, It last, std::ptrdiff_t n, std::random_access_iterator_tag)
+    {
+#if defined(__GNUC__)
+        using Value = typename std::iterator_traits<It>::value_type;
+        constexpr std::ptrdiff_t step = (sizeof(Value) < 64)? 64 / sizeof(Value) : 1;
+        n = std::min(n, last - it);
+        for (std::ptrdiff_t i = 0; i < n; i += step)
+        {
+            __builtin_prefetch(std::addressof(it[i]));
+        }
+#else
+        (void)it; (void)last; (void)n;
+#endif
+    }
+    
+    template <typename It>
+    void prefetch(It, It, std::ptrdiff_t, std::input_iterator_tag)
+    {}
+    
+    // Gives iterators access to their container's instrumentation,
+    // without taking up any space when it is disabled.
+    template <typename I, bool = I::enabled>
+    class InstrumentationRef
+    {
+    public:
+        SPARSE_MULTI_VEC_CONSTEXPR InstrumentationRef(I* i = nullptr)
+            : instr{i}
+        {}
+        
+        SPARSE_MULTI_VEC_CONSTEXPR I& instrumentation() const
+        {
+            return *instr;
+        }
+        
+    private:
+        I* instr;
+    };
+    
+    template <typename I>
+    class InstrumentationRef<I, false>
+    {
+    public:
+        SPARSE_MULTI_VEC_CONSTEXPR InstrumentationRef(I* = nullptr)
+        {}
+        
+        SPARSE_MULTI_VEC_CONSTEXPR I instrumentation() const
+        {
+            return {};
+        }
+    };
+    
+} // namespace detailSparseContainer
+
+template <template <typename> class Container, typename T, typename Instrumentation = NoInstrumentation>
 class SparseContainer
+    : private Instrumentation
 {
     class Item
     {
     public:
-        Item()
+        SPARSE_MULTI_VEC_CONSTEXPR Item()
             : toNext{0}
             , value{}
         {}
         
         template <typename A>
-        Item(A&& in)
+        SPARSE_MULTI_VEC_CONSTEXPR Item(A&& in)
             : toNext{0}
             , value{std::forward<A>(in)}
         {}
@@ -59,35 +310,91 @@ class SparseContainer
     using DataIter = typename Data::iterator;
     
 public:
-    class iterator
+    using instrumentation_type = Instrumentation;
+    using delta_type = SparseDelta<T>;
+    
+    template <bool Const>
+    class basic_iterator
+        : private detailSparseContainer::InstrumentationRef<Instrumentation>
     {
         friend SparseContainer;
+        
+        using Iter = typename std::conditional<Const, typename Data::const_iterator, DataIter>::type;
+        
     public:
         using value_type = T;
-        using pointer = value_type*;
-        using reference = value_type&;
+        using pointer = typename std::conditional<Const, const value_type*, value_type*>::type;
+        using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
         using iterator_category = std::forward_iterator_tag;
         using difference_type = std::ptrdiff_t;
 
         using const_reference = const value_type&;
         using const_pointer = const value_type*;
 
-        iterator() = default;
+        SPARSE_MULTI_VEC_CONSTEXPR basic_iterator()
+            : pos{0}
+            , iter{}
+        {}
         
         template <typename A>
-        iterator(int p, A&& i)
-            : pos{p}
+        SPARSE_MULTI_VEC_CONSTEXPR basic_iterator(int p, A&& i, Instrumentation* s = nullptr)
+            : detailSparseContainer::InstrumentationRef<Instrumentation>{s}
+            , pos{p}
             , iter{std::forward<A>(i)}
         {}
         
-        pointer operator*()
+        SPARSE_MULTI_VEC_CONSTEXPR pointer operator*() const
         {
             return (pos == 0)? &(iter->value) : nullptr;
         }
         
-        iterator& operator++()
+        // Number of nulls from here to the next solid element.
+        SPARSE_MULTI_VEC_CONSTEXPR int gap() const
+        {
+            if (pos < 0) return -pos;
+            if (pos == 0) return 0;
+            return iter->toNext - pos + 1;
+        }
+        
+        // Advances n elements, a whole run at a time.
+        SPARSE_MULTI_VEC_CONSTEXPR basic_iterator& skip(int n)
+        {
+            while (n > 0)
+            {
+                if (pos < 0)
+                {
+                    auto len = std::min(n, -pos);
+                    pos += len;
+                    n -= len;
+                }
+                else if (n > iter->toNext - pos)
+                {
+                    n -= iter->toNext - pos + 1;
+                    pos = 0;
+                    ++iter;
+                }
+                else
+                {
+                    pos += n;
+                    n = 0;
+                }
+            }
+            return *this;
+        }
+        
+        SPARSE_MULTI_VEC_CONSTEXPR basic_iterator& operator++()
         {
-            if (++pos > iter->toNext)
+            if (Instrumentation::enabled)
+            {
+                if (pos == 0) this->instrumentation().stepSolid();
+                else this->instrumentation().stepGap();
+            }
+            
+            if (pos < 0)
+            {
+                ++pos;
+            }
+            else if (++pos > iter->toNext)
             {
                 pos = 0;
                 ++iter;
@@ -95,7 +402,7 @@ public:
             return *this;
         }
         
-        bool operator==(const iterator& in) const
+        SPARSE_MULTI_VEC_CONSTEXPR bool operator==(const basic_iterator& in) const
         {
             return (
                    std::tie(   pos,    iter)
@@ -103,7 +410,7 @@ public:
             );
         }
         
-        bool operator!=(const iterator& in) const
+        SPARSE_MULTI_VEC_CONSTEXPR bool operator!=(const basic_iterator& in) const
         {
             return (
                    std::tie(   pos,    iter)
@@ -112,374 +419,3123 @@ public:
         }
         
     private:
-        int      pos;
-        DataIter iter;
+        int  pos;
+        Iter iter;
     };
     
-    SparseContainer()
-        : toFirst{0}
+    using iterator       = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+    
+    SPARSE_MULTI_VEC_CONSTEXPR SparseContainer()
+        : Instrumentation{}
+        , toFirst{0}
         , data{}
+        , sz{0}
+        , runs{0}
     {}
     
     template <typename A>
-    void push_back(A&& in)
+    SPARSE_MULTI_VEC_CONSTEXPR void push_back(A&& in)
     {
-        data.emplace_back(in);
+        if (Instrumentation::enabled)
+        {
+            instr().pushSolid((data.size() == 0)? toFirst : data.back().toNext);
+        }
+        
+        auto cap = detailSparseContainer::capacity(data, 0);
+        data.emplace_back(std::forward<A>(in));
         ++sz;
+        countReallocation(cap);
     }
     
-    void push_back(decltype(nullptr))
+    SPARSE_MULTI_VEC_CONSTEXPR void push_back(decltype(nullptr))
     {
-        if (data.size() == 0) ++toFirst;
-        else ++data.back().toNext;
+        auto& run = (data.size() == 0)? toFirst : data.back().toNext;
+        if (run++ == 0) ++runs;
         ++sz;
+        instr().pushNull();
     }
     
-    iterator erase(iterator it)
+    SPARSE_MULTI_VEC_CONSTEXPR iterator erase(iterator it)
     {
-        if (it == begin(*this)) return erase_front();
+        --sz;
         
-        if (it.pos == 0)
+        if (it.pos < 0)
         {
-            if (it.iter->toNext == 0)
-            {
-                return {0, data.erase(it.iter)};
-            }
-            else
+            if (--toFirst == 0) --runs;
+            ++it.pos;
+            return it;
+        }
+        else if (it.pos > 0)
+        {
+            if (it.iter->toNext == 1) --runs;
+            if (--it.iter->toNext < it.pos)
             {
-                auto prev = it.iter;
-                --prev;
-                auto newPos = prev->toNext;
-                prev->toNext += it.iter->toNext;
-                data.erase(it.iter);
-                return {newPos, prev};
+                it.pos = 0;
+                ++it.iter;
             }
+            return it;
         }
-        else if (it.pos < 0)
+        
+        if (Instrumentation::enabled)
         {
-            --toFirst;
-            ++it.pos;
-            return it;
+            auto after = std::distance(it.iter, end(data)) - 1;
+            instr().eraseMoved(after * sizeof(Item));
+        }
+        
+        if (it.iter == begin(data))
+        {
+            if (toFirst > 0 && it.iter->toNext > 0) --runs;
+            auto oldFirst = toFirst;
+            toFirst += it.iter->toNext;
+            auto next = data.erase(it.iter);
+            return {oldFirst - toFirst, next, &instr()};
+        }
+        else if (it.iter->toNext == 0)
+        {
+            return {0, data.erase(it.iter), &instr()};
         }
         else
         {
-            --it.pos;
-            --it.iter->toNext;
-            return ++it;
+            auto prev = it.iter;
+            --prev;
+            if (prev->toNext > 0) --runs;
+            auto newPos = prev->toNext + 1;
+            prev->toNext += it.iter->toNext;
+            data.erase(it.iter);
+            return {newPos, prev, &instr()};
         }
     }
     
     iterator erase_front()
     {
-        auto it = begin(data);
-        toFirst += it->toNext;
-        data.erase(it);
-        return begin(*this);
+        return erase(begin(*this));
     }
     
-    int size() const
+    // Makes the element at it solid, splitting its null run if it was null.
+    template <typename A>
+    iterator set(iterator it, A&& in)
     {
-        return sz;
+        if (it.pos == 0)
+        {
+            it.iter->value = std::forward<A>(in);
+            return it;
+        }
+        
+        auto& gap = (it.pos < 0)? toFirst : it.iter->toNext;
+        auto before = (it.pos < 0)? toFirst + it.pos : it.pos - 1;
+        auto after = gap - before - 1;
+        auto where = (it.pos < 0)? it.iter : std::next(it.iter);
+        
+        runs += (before > 0) + (after > 0) - 1;
+        gap = before;
+        
+        auto cap = detailSparseContainer::capacity(data, 0);
+        auto item = data.emplace(where, std::forward<A>(in));
+        item->toNext = after;
+        countReallocation(cap);
+        return {0, item, &instr()};
     }
     
-    friend iterator begin(SparseContainer& in)
+    // Makes the element at it null, joining the runs on either side.
+    iterator reset(iterator it)
     {
-        return {-in.toFirst, begin(in.data)};
+        if (it.pos != 0) return it;
+        
+        auto after = it.iter->toNext;
+        
+        if (it.iter == begin(data))
+        {
+            runs += 1 - (toFirst > 0) - (after > 0);
+            auto oldFirst = toFirst;
+            toFirst += 1 + after;
+            return {oldFirst - toFirst, data.erase(it.iter), &instr()};
+        }
+        
+        auto prev = std::prev(it.iter);
+        runs += 1 - (prev->toNext > 0) - (after > 0);
+        auto newPos = prev->toNext + 1;
+        prev->toNext += 1 + after;
+        data.erase(it.iter);
+        return {newPos, prev, &instr()};
     }
-
-    friend iterator end(SparseContainer& in)
+    
+    // Moves all of in's elements onto the end of this container.
+    // The null run at our tail is joined with the one at in's head,
+    // so this is proportional to the number of solid items in in.
+    // The items go over in one insert, a memmove when they are trivial.
+    void append(SparseContainer&& in)
     {
-        return {0, end(in.data)};
+        auto& run = (data.size() == 0)? toFirst : data.back().toNext;
+        if (run > 0 && in.toFirst > 0) --runs;
+        run += in.toFirst;
+        
+        auto cap = detailSparseContainer::capacity(data, 0);
+        data.insert(end(data), std::make_move_iterator(begin(in.data)), std::make_move_iterator(end(in.data)));
+        countReallocation(cap);
+        
+        sz += in.sz;
+        runs += in.runs;
+        
+        in.toFirst = 0;
+        in.data.clear();
+        in.sz = 0;
+        in.runs = 0;
     }
-
-    friend iterator begin(SparseContainer&& in)
+    
+    // Moves the elements from index onwards into a new container.
+    // The items are found by walking back from the end, so this is
+    // proportional to the number of solid items moved.
+    // index must be in [0, size()].
+    SparseContainer split_at(int index)
     {
-        return {-in.toFirst, begin(in.data)};
+        assert(0 <= index && index <= sz);
+        
+        SparseContainer rval;
+        
+        auto it  = end(data);
+        auto row = sz;
+        while (it != begin(data))
+        {
+            auto prev = std::prev(it);
+            auto start = row - 1 - prev->toNext;
+            if (start < index) break;
+            row = start;
+            it = prev;
+        }
+        
+        auto& gap = (it == begin(data))? toFirst : std::prev(it)->toNext;
+        auto hadGap = (gap > 0);
+        rval.toFirst = row - index;
+        gap -= rval.toFirst;
+        runs += (gap > 0) - hadGap;
+        rval.runs = (rval.toFirst > 0);
+        
+        for (auto i = it; i != end(data); ++i)
+        {
+            if (i->toNext > 0)
+            {
+                --runs;
+                ++rval.runs;
+            }
+        }
+        rval.data.insert(end(rval.data), std::make_move_iterator(it), std::make_move_iterator(end(data)));
+        rval.countReallocation(0);
+        data.erase(it, end(data));
+        
+        rval.sz = sz - index;
+        sz = index;
+        
+        return rval;
     }
-
-    friend iterator end(SparseContainer&& in)
+    
+    // Reorders the elements so that element i is the one that was at perm[i].
+    // perm must have exactly size() entries.
+    void apply_permutation(const std::vector<int>& perm)
     {
-        return {0, end(in.data)};
+        assert(int(perm.size()) == sz);
+        
+        std::vector<T*> rows;
+        rows.reserve(sz);
+        for (auto it = begin(*this), e = end(*this); it != e; ++it)
+        {
+            rows.push_back(*it);
+        }
+        
+        SparseContainer rval;
+        detailSparseContainer::reserve(rval.data, data.size(), 0);
+        for (auto i : perm)
+        {
+            if (rows[i]) rval.push_back(std::move(*rows[i]));
+            else rval.push_back(nullptr);
+        }
+        
+        rval.instr() = std::move(instr());
+        *this = std::move(rval);
+        countReallocation(0);
     }
-
-private:
-    int toFirst;
-    Data data;
-    int sz;
-};
-
-namespace detailMultiContainer
-{
-    template <typename T>
-    struct DereferenceType
-    {
-        using type = decltype(*T{});
-    };
-
-    template <typename T>
-    struct iteratorType
+    
+    SPARSE_MULTI_VEC_CONSTEXPR int size() const
     {
-        using type = decltype(begin(std::declval<T>()));
-    };
-
-    template <typename T>
-    struct TupleSize
+        return sz;
+    }
+    
+    int solid_count() const
     {
-        using RawType = typename std::decay<T>::type;
-        static constexpr auto value = std::tuple_size<RawType>::value;
-    };
+        return data.size();
+    }
     
-    template <int N>
-    struct MakeBeginRecurse
+    // The element at index, or nullptr if it is null.
+    // Gets there a run at a time, like iterator::skip.
+    T* get(int index)
     {
-        template <typename I, typename T>
-        static void makeBegin(I&& i, T&& t)
-        {
-            std::get<N>(i) = begin(std::get<N>(t));
-            MakeBeginRecurse<N-1>::makeBegin(i, t);
-        }
-    };
+        auto it = begin(*this);
+        return *it.skip(index);
+    }
     
-    template <>
-    struct MakeBeginRecurse<0>
+    const T* get(int index) const
     {
-        template <typename I, typename T>
-        static void makeBegin(I&& i, T&& t)
-        {
-            std::get<0>(i) = begin(std::get<0>(t));
-        }
-    };
+        auto it = begin(*this);
+        return *it.skip(index);
+    }
     
-    template <typename I, typename T>
-    void makeBegin(I&& i, T&& t)
+    int null_count() const
     {
-        MakeBeginRecurse<TupleSize<I>::value-1>::makeBegin(i, t);
+        return sz - data.size();
     }
     
-    template <int N>
-    struct MakeEndRecurse
+    // Number of maximal runs of consecutive nulls.
+    int run_count() const
     {
-        template <typename I, typename T>
-        static void makeEnd(I&& i, T&& t)
-        {
-            std::get<N>(i) = end(std::get<N>(t));
-            MakeEndRecurse<N-1>::makeEnd(i, t);
-        }
-    };
+        return runs;
+    }
     
-    template <>
-    struct MakeEndRecurse<0>
+    // Includes unused capacity of the underlying container.
+    std::size_t memory_bytes() const
     {
-        template <typename I, typename T>
-        static void makeEnd(I&& i, T&& t)
-        {
-            std::get<0>(i) = end(std::get<0>(t));
-        }
-    };
+        return sizeof(*this) + detailSparseContainer::heapCapacity(data, 0) * sizeof(Item);
+    }
     
-    template <typename I, typename T>
-    void makeEnd(I&& i, T&& t)
+    SparseStats stats() const
     {
-        MakeEndRecurse<TupleSize<I>::value-1>::makeEnd(i, t);
+        return {solid_count(), null_count(), run_count(), memory_bytes()};
     }
     
-    template <int N>
-    struct IndirectionRecurse
+    // Checks that the run bookkeeping agrees with the runs themselves.
+    // Meant for asserts and tests; it visits every solid item.
+    bool valid() const
     {
-        template <typename T, typename I>
-        static void indirection(T&& p, I&& i)
+        if (toFirst < 0) return false;
+        
+        long long rows = toFirst + data.size();
+        int gaps = (toFirst > 0);
+        for (auto&& item : data)
         {
-            std::get<N>(p) = *std::get<N>(i);
-            IndirectionRecurse<N-1>::indirection(p, i);
+            if (item.toNext < 0) return false;
+            rows += item.toNext;
+            gaps += (item.toNext > 0);
         }
-    };
-
-    template <>
-    struct IndirectionRecurse<0>
+        
+        return rows == sz && gaps == runs;
+    }
+    
+    // Decodes the next n elements at it into out, nullptr for the nulls,
+    // and advances it past them. Bit i of the result is set if out[i] is solid.
+    // n must be at most 64 and no more than the elements left.
+    std::uint64_t decode(iterator& it, int n, T** out)
     {
-        template <typename T, typename I>
-        static void indirection(T&& p, I&& i)
+        std::uint64_t mask = 0;
+        int i = 0;
+        
+        while (i < n)
         {
-            std::get<0>(p) = *std::get<0>(i);
+            if (it.pos == 0)
+            {
+                out[i] = &(it.iter->value);
+                mask |= std::uint64_t{1} << i;
+                ++i;
+                if (it.iter->toNext == 0) ++it.iter;
+                else it.pos = 1;
+                continue;
+            }
+            
+            auto gap = (it.pos < 0)? -it.pos : it.iter->toNext - it.pos + 1;
+            auto len = std::min(gap, n - i);
+            std::fill(out + i, out + i + len, nullptr);
+            i += len;
+            it.pos += len;
+            
+            if (it.pos > 0 && it.pos > it.iter->toNext)
+            {
+                it.pos = 0;
+                ++it.iter;
+            }
         }
-    };
-
-    template <typename T, typename I>
-    void indirection(T&& p, I&& i)
+        
+        detailSparseContainer::prefetch(it.iter, end(data), 64,
+            typename std::iterator_traits<DataIter>::iterator_category{});
+        
+        return mask;
+    }
+    
+    // Column algorithms. These visit the solid elements in order,
+    // straight out of the underlying container, without walking the gaps.
+    
+    template <typename U, typename Op>
+    U reduce(U init, Op op) const
     {
-        IndirectionRecurse<TupleSize<T>::value-1>::indirection(p,i);
+        for (auto&& item : data) init = op(std::move(init), item.value);
+        return init;
     }
     
-    template <int N>
-    struct IncrementRecurse
+    template <typename F>
+    void transform(F f)
     {
-        template <typename T>
-        static void increment(T&& i)
+        for (auto&& item : data) item.value = f(item.value);
+    }
+    
+    template <typename Pred>
+    int count_if(Pred pred) const
+    {
+        int rval = 0;
+        for (auto&& item : data) rval += bool(pred(item.value));
+        return rval;
+    }
+    
+    // Builds a column from n values, skipping those whose mask byte is zero.
+    // A null mask means every value is present. The mask is read eight bytes
+    // at a time, so all-null and all-solid stretches are handled in bulk.
+    static SparseContainer from_column(const T* values, const std::uint8_t* mask, int n)
+    {
+        SparseContainer rval;
+        int i = 0;
+        
+        if (!mask)
         {
-            ++std::get<N>(i);
-            IncrementRecurse<N-1>::increment(i);
+            detailSparseContainer::reserve(rval.data, n, 0);
+            rval.countReallocation(0);
+            for (; i < n; ++i) rval.push_back(values[i]);
+            return rval;
         }
-    };
+        
+        for (; i + 8 <= n; i += 8)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, mask + i, sizeof(word));
+            
+            if (word == 0)
+            {
+                rval.pushNulls(8);
+            }
+            else if (!detailSparseContainer::hasZeroByte(word))
+            {
+                for (int k = 0; k < 8; ++k) rval.push_back(values[i + k]);
+            }
+            else
+            {
+                for (int k = 0; k < 8; ++k)
+                {
+                    if (mask[i + k]) rval.push_back(values[i + k]);
+                    else rval.pushNulls(1);
+                }
+            }
+        }
+        
+        for (; i < n; ++i)
+        {
+            if (mask[i]) rval.push_back(values[i]);
+            else rval.pushNulls(1);
+        }
+        
+        return rval;
+    }
     
-    template <>
-    struct IncrementRecurse<0>
+    // Writes the column out as a bitmap and a slot per row,
+    // touching only the solid items and the bits they set.
+    ColumnBuffers<T> export_buffers() const
     {
-        template <typename T>
-        static void increment(T&& i)
+        static_assert(std::is_trivially_copyable<T>::value, "Column buffers hold plain values!");
+        
+        ColumnBuffers<T> rval{sz, null_count(), std::vector<std::uint8_t>((sz + 7) / 8), nullptr, std::vector<T>(sz)};
+        auto row = toFirst;
+        for (auto&& item : data)
         {
-            ++std::get<0>(i);
+            rval.owned[row] = item.value;
+            rval.validity[row / 8] |= std::uint8_t(1u << (row % 8));
+            row += 1 + item.toNext;
         }
-    };
+        return rval;
+    }
     
-    template <typename T>
-    void increment(T&& t)
+    // Reads a column from n slots and a validity bitmap, or a null bitmap
+    // if every row is present. Whole words of the bitmap that are all
+    // clear or all set are pushed 64 rows at a time.
+    static SparseContainer import_buffers(const T* values, const std::uint8_t* validity, int n)
     {
-        IncrementRecurse<TupleSize<T>::value-1>::increment(t);
+        static_assert(std::is_trivially_copyable<T>::value, "Column buffers hold plain values!");
+        
+        if (!validity) return from_column(values, nullptr, n);
+        
+        SparseContainer rval;
+        int i = 0;
+        
+        for (; i + 64 <= n; i += 64)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, validity + i / 8, sizeof(word));
+            
+            if (word == 0)
+            {
+                rval.pushNulls(64);
+                continue;
+            }
+            
+            auto full = (word == ~std::uint64_t{0});
+            for (int k = i; k < i + 64; ++k)
+            {
+                if (full || (validity[k / 8] >> (k % 8)) & 1) rval.push_back(values[k]);
+                else rval.pushNulls(1);
+            }
+        }
+        
+        for (; i < n; ++i)
+        {
+            if ((validity[i / 8] >> (i % 8)) & 1) rval.push_back(values[i]);
+            else rval.pushNulls(1);
+        }
+        
+        return rval;
     }
     
-    template <int N>
-    struct EraseRecurse
+    // The edits that turn prev into next. Rows are matched by position,
+    // and runs of nulls common to both are kept in one step.
+    static delta_type diff(const SparseContainer& prev, const SparseContainer& next)
     {
-        template <typename C, typename T>
-        static void erase(C& c, const T& t, T& u)
+        delta_type rval{prev.sz, next.sz, {}, {}};
+        
+        auto a = begin(prev);
+        auto b = begin(next);
+        int i = 0;
+        
+        while (i < next.sz)
         {
-            std::get<N>(u) = std::get<N>(c).erase(std::get<N>(t));
-            EraseRecurse<N-1>::erase(c, t, u);
+            auto old = (i < prev.sz);
+            auto n = 1;
+            
+            if (b.gap() > 0)
+            {
+                auto keep = old && a.gap() > 0;
+                n = (old)? std::min(b.gap(), std::max(a.gap(), 1)) : b.gap();
+                rval.add(keep? delta_type::Edit::Keep : delta_type::Edit::Null, n);
+            }
+            else if (old && *a && **a == **b)
+            {
+                rval.add(delta_type::Edit::Keep, 1);
+            }
+            else
+            {
+                rval.add(delta_type::Edit::Set, 1);
+                rval.values.push_back(**b);
+            }
+            
+            if (old) a.skip(std::min(n, prev.sz - i));
+            b.skip(n);
+            i += n;
         }
-    };
+        
+        return rval;
+    }
     
-    template <>
-    struct EraseRecurse<0>
+    // Turns this container into the next of the diff that made in.
+    // This must be the prev of that diff, or equal to it.
+    void apply(const delta_type& in)
     {
-        template <typename C, typename T>
-        static void erase(C& c, const T& t, T& u)
+        assert(in.from == sz);
+        
+        SparseContainer rval;
+        detailSparseContainer::reserve(rval.data, data.size(), 0);
+        
+        auto it = begin(*this);
+        auto value = in.values.begin();
+        int i = 0;
+        
+        for (auto& edit : in.edits)
         {
-            std::get<0>(u) = std::get<0>(c).erase(std::get<0>(t));
+            auto n = edit.count;
+            
+            if (edit.kind == delta_type::Edit::Keep)
+            {
+                while (n > 0)
+                {
+                    auto len = std::min(it.gap(), n);
+                    if (len > 0)
+                    {
+                        rval.pushNulls(len);
+                    }
+                    else
+                    {
+                        rval.push_back(std::move(**it));
+                        len = 1;
+                    }
+                    it.skip(len);
+                    n -= len;
+                }
+            }
+            else
+            {
+                if (edit.kind == delta_type::Edit::Null) rval.pushNulls(n);
+                else for (auto k = 0; k < n; ++k) rval.push_back(*value++);
+                it.skip(std::max(0, std::min(n, sz - i)));
+            }
+            
+            i += edit.count;
         }
-    };
+        
+        assert(rval.sz == in.to);
+        rval.instr() = std::move(instr());
+        *this = std::move(rval);
+        countReallocation(0);
+    }
     
-    template <typename C, typename T>
-    void erase(C& c, const T& t, T& u)
+    const Instrumentation& instrumentation() const
     {
-        EraseRecurse<TupleSize<T>::value-1>::erase(c, t, u);
+        return instr();
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR friend iterator begin(SparseContainer& in)
+    {
+        return {-in.toFirst, begin(in.data), &in.instr()};
     }
 
-} // namespace detailMultiContainer
+    SPARSE_MULTI_VEC_CONSTEXPR friend iterator end(SparseContainer& in)
+    {
+        return {0, end(in.data), &in.instr()};
+    }
 
-template <template <typename> class Container, typename... Types>
-class MultiContainer;
+    SPARSE_MULTI_VEC_CONSTEXPR friend iterator begin(SparseContainer&& in)
+    {
+        return {-in.toFirst, begin(in.data), &in.instr()};
+    }
 
-template <template <typename> class Container, typename... Types>
-typename MultiContainer<Container, Types...>::iterator begin(MultiContainer<Container, Types...>& in);
+    SPARSE_MULTI_VEC_CONSTEXPR friend iterator end(SparseContainer&& in)
+    {
+        return {0, end(in.data), &in.instr()};
+    }
 
-template <template <typename> class Container, typename... Types>
-typename MultiContainer<Container, Types...>::iterator end(MultiContainer<Container, Types...>& in);
+    SPARSE_MULTI_VEC_CONSTEXPR friend const_iterator begin(const SparseContainer& in)
+    {
+        return {-in.toFirst, begin(in.data), &in.instr()};
+    }
 
-template <template <typename> class Container, typename... Types>
-class MultiContainer
-{
-    static_assert(sizeof...(Types) > 0, "Must have at least one type!");
-    
-    using Tuple = std::tuple<Container<Types>...>;
-    
-    template <typename A>
-    using Iter = typename detailMultiContainer::iteratorType<Container<A>>::type;
+    SPARSE_MULTI_VEC_CONSTEXPR friend const_iterator end(const SparseContainer& in)
+    {
+        return {0, end(in.data), &in.instr()};
+    }
+
+private:
+    // The policy is a private base, so an empty one takes no space.
+    // Iterators over a const container still count their steps.
+    SPARSE_MULTI_VEC_CONSTEXPR Instrumentation& instr() const
+    {
+        return const_cast<SparseContainer&>(*this);
+    }
     
-    template <typename A>
-    using Deref = typename detailMultiContainer::DereferenceType<Iter<A>>::type;
+    // Tells the instrumentation if data is no longer in a buffer of cap items.
+    // Everything that can grow data goes through here; rebuilds that swap
+    // in a new data pass 0, since their items are always in a fresh buffer.
+    SPARSE_MULTI_VEC_CONSTEXPR void countReallocation(std::size_t cap)
+    {
+        if (Instrumentation::enabled && detailSparseContainer::capacity(data, 0) != cap)
+        {
+            instr().reallocate();
+        }
+    }
     
-    using TupleIter = std::tuple<Iter<Types>...>;
+    // Appends n nulls as one run.
+    void pushNulls(int n)
+    {
+        auto& run = (data.size() == 0)? toFirst : data.back().toNext;
+        if (run == 0) ++runs;
+        run += n;
+        sz += n;
+    }
     
-    using TupleRef = std::tuple<Deref<Types>...>;
+    int toFirst;
+    Data data;
+    int sz;
+    int runs;
+};
+
+// Density thresholds for HybridContainer, in percent of solid elements.
+// The gap between them keeps a column from flipping back and forth.
+struct DefaultHybridThresholds
+{
+    static constexpr int toDense  = 95;
+    static constexpr int toSparse = 80;
+    static constexpr int minSize  = 64;
+};
+
+// A column that is a SparseContainer while it is sparse,
+// and a plain Container<T> plus a presence mask while it is dense.
+// Representation is reconsidered on push_back and rebalance(),
+// either of which may invalidate iterators.
+template <template <typename> class Container, typename T, typename Thresholds = DefaultHybridThresholds>
+class HybridContainer
+{
+    using Sparse     = SparseContainer<Container, T>;
+    using SparseIter = typename Sparse::iterator;
+    using Dense      = Container<T>;
+    using DenseIter  = typename Dense::iterator;
     
 public:
     class iterator
     {
-        friend MultiContainer;
+        friend HybridContainer;
+    public:
+        using value_type = T;
+        using pointer = value_type*;
+        using reference = value_type&;
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+
+        using const_reference = const value_type&;
+        using const_pointer = const value_type*;
+
+        iterator() = default;
         
-        friend iterator begin<>(MultiContainer& in);
-        friend iterator end<>(MultiContainer& in);
+        iterator(SparseIter s)
+            : sparse{s}
+            , dense{}
+            , index{-1}
+            , mask{nullptr}
+        {}
         
-    public:
-        TupleRef operator*()
+        iterator(DenseIter d, int i, const std::vector<bool>* m)
+            : sparse{}
+            , dense{d}
+            , index{i}
+            , mask{m}
+        {}
+        
+        pointer operator*() const
         {
-            TupleRef rval;
-            detailMultiContainer::indirection(rval, iter);
-            return rval;
+            if (index < 0) return *sparse;
+            return (!mask || (*mask)[index])? &*dense : nullptr;
+        }
+        
+        int gap() const
+        {
+            if (index < 0) return sparse.gap();
+            return (!mask || (*mask)[index])? 0 : 1;
+        }
+        
+        iterator& skip(int n)
+        {
+            if (index < 0)
+            {
+                sparse.skip(n);
+            }
+            else
+            {
+                std::advance(dense, n);
+                index += n;
+            }
+            return *this;
         }
         
         iterator& operator++()
         {
-            detailMultiContainer::increment(iter);
+            if (index < 0)
+            {
+                ++sparse;
+            }
+            else
+            {
+                ++dense;
+                ++index;
+            }
             return *this;
         }
         
-        bool operator==(const iterator& in)
+        bool operator==(const iterator& in) const
         {
-            return (iter == in.iter);
+            return (index < 0)? (sparse == in.sparse) : (index == in.index);
         }
         
         bool operator!=(const iterator& in) const
         {
-            return (iter != in.iter);
+            return !(*this == in);
         }
         
     private:
-        TupleIter iter;
+        SparseIter               sparse;
+        DenseIter                dense;
+        int                      index;
+        const std::vector<bool>* mask;
     };
     
-    MultiContainer()
-        : data{}
+    HybridContainer()
+        : sparse{}
+        , values{}
+        , present{}
+        , nulls{0}
+        , runs{0}
+        , dense{false}
     {}
     
-    template <typename... A>
-    void push_back(A&&... in)
+    template <typename A>
+    void push_back(A&& in)
     {
-        static_assert(sizeof...(A) == std::tuple_size<Tuple>::value, "Argument count must match container count!");
-        push_backer(in...);
+        if (dense)
+        {
+            values.emplace_back(std::forward<A>(in));
+            present.push_back(true);
+        }
+        else
+        {
+            sparse.push_back(std::forward<A>(in));
+        }
+        rebalance();
+    }
+    
+    void push_back(decltype(nullptr))
+    {
+        if (dense)
+        {
+            if (present.empty() || present.back()) ++runs;
+            values.emplace_back();
+            present.push_back(false);
+            ++nulls;
+        }
+        else
+        {
+            sparse.push_back(nullptr);
+        }
+        rebalance();
     }
     
     iterator erase(iterator it)
     {
-        iterator rval;
-        detailMultiContainer::erase(data, it.iter, rval.iter);
-        return rval;
+        if (!dense) return sparse.erase(it.sparse);
+        
+        auto i = it.index;
+        bool before = (i > 0 && !present[i-1]);
+        bool after  = (i+1 < int(present.size()) && !present[i+1]);
+        
+        if (present[i])
+        {
+            if (before && after) --runs;
+        }
+        else
+        {
+            if (!before && !after) --runs;
+            --nulls;
+        }
+        
+        present.erase(begin(present) + i);
+        return {values.erase(it.dense), i, nulls? &present : nullptr};
     }
     
-    friend iterator begin<>(MultiContainer& in);
-    friend iterator end<>(MultiContainer& in);
-
-private:
-    template <int N = 0, typename A, typename... B>
-    void push_backer(A&& a, B&&... o)
+    template <typename A>
+    iterator set(iterator it, A&& in)
     {
-        std::get<N>(data).push_back(a);
-        push_backer<N+1>(o...);
+        if (!dense) return sparse.set(it.sparse, std::forward<A>(in));
+        
+        *it.dense = std::forward<A>(in);
+        if (!present[it.index])
+        {
+            updateRuns(it.index, -1);
+            present[it.index] = true;
+            --nulls;
+        }
+        return it;
     }
     
-    template <int>
-    void push_backer()
-    {}
-
-    Tuple data;
-};
-
-template <template <typename> class Container, typename... Types>
-typename MultiContainer<Container, Types...>::iterator begin(MultiContainer<Container, Types...>& in)
-{
-    typename MultiContainer<Container, Types...>::iterator rval;
-    detailMultiContainer::makeBegin(rval.iter, in.data);
-    return rval;
-}
-
-template <template <typename> class Container, typename... Types>
-typename MultiContainer<Container, Types...>::iterator end(MultiContainer<Container, Types...>& in)
-{
-    typename MultiContainer<Container, Types...>::iterator rval;
-    detailMultiContainer::makeEnd(rval.iter, in.data);
-    return rval;
+    iterator reset(iterator it)
+    {
+        if (!dense) return sparse.reset(it.sparse);
+        
+        if (present[it.index])
+        {
+            updateRuns(it.index, +1);
+            present[it.index] = false;
+            ++nulls;
+            it.mask = &present;
+        }
+        return it;
+    }
+    
+    void append(HybridContainer&& in)
+    {
+        if (!dense && !in.dense)
+        {
+            sparse.append(std::move(in.sparse));
+            rebalance();
+            return;
+        }
+        
+        for (auto it = begin(in), e = end(in); it != e; ++it)
+        {
+            auto p = *it;
+            if (p) push_back(std::move(*p));
+            else push_back(nullptr);
+        }
+        in = HybridContainer{};
+    }
+    
+    // See SparseContainer::apply_permutation.
+    void apply_permutation(const std::vector<int>& perm)
+    {
+        assert(int(perm.size()) == size());
+        
+        if (!dense)
+        {
+            sparse.apply_permutation(perm);
+            return;
+        }
+        
+        Dense v;
+        std::vector<bool> p;
+        for (auto i : perm)
+        {
+            v.emplace_back(std::move(values[i]));
+            p.push_back(present[i]);
+        }
+        values = std::move(v);
+        present = std::move(p);
+        
+        runs = 0;
+        for (std::size_t i = 0; i < present.size(); ++i)
+        {
+            if (!present[i] && (i == 0 || present[i-1])) ++runs;
+        }
+    }
+    
+    // See SparseContainer::split_at.
+    HybridContainer split_at(int index)
+    {
+        assert(0 <= index && index <= size());
+        
+        HybridContainer rval;
+        
+        if (!dense)
+        {
+            rval.sparse = sparse.split_at(index);
+        }
+        else
+        {
+            auto v = begin(values) + index;
+            rval.values.insert(end(rval.values), std::make_move_iterator(v), std::make_move_iterator(end(values)));
+            for (auto i = std::size_t(index); i < present.size(); ++i)
+            {
+                rval.present.push_back(present[i]);
+                
+                if (!present[i])
+                {
+                    ++rval.nulls;
+                    if (i == std::size_t(index) || present[i-1]) ++rval.runs;
+                    if (i == 0 || present[i-1]) --runs;
+                }
+            }
+            values.erase(begin(values) + index, end(values));
+            present.erase(begin(present) + index, end(present));
+            nulls -= rval.nulls;
+            rval.dense = true;
+        }
+        
+        rebalance();
+        rval.rebalance();
+        return rval;
+    }
+    
+    // Switches representation if the density has crossed a threshold.
+    void rebalance()
+    {
+        long long n = size();
+        if (n < Thresholds::minSize) return;
+        
+        long long solid = solid_count();
+        
+        if (!dense && solid * 100 >= n * Thresholds::toDense) makeDense();
+        else if (dense && solid * 100 < n * Thresholds::toSparse) makeSparse();
+    }
+    
+    bool is_dense() const
+    {
+        return dense;
+    }
+    
+    int size() const
+    {
+        return dense? int(present.size()) : sparse.size();
+    }
+    
+    // See SparseContainer::valid.
+    bool valid() const
+    {
+        if (!dense) return sparse.valid() && nulls == 0 && runs == 0 && present.empty();
+        
+        int n = 0;
+        int r = 0;
+        for (std::size_t i = 0; i < present.size(); ++i)
+        {
+            if (present[i]) continue;
+            ++n;
+            if (i == 0 || present[i-1]) ++r;
+        }
+        
+        return sparse.size() == 0 && values.size() == present.size() && n == nulls && r == runs;
+    }
+    
+    // See SparseContainer::get. Constant time while dense.
+    T* get(int index)
+    {
+        if (!dense) return sparse.get(index);
+        return present[index]? &*std::next(begin(values), index) : nullptr;
+    }
+    
+    const T* get(int index) const
+    {
+        if (!dense) return sparse.get(index);
+        return present[index]? &*std::next(begin(values), index) : nullptr;
+    }
+    
+    int solid_count() const
+    {
+        return dense? int(present.size()) - nulls : sparse.solid_count();
+    }
+    
+    int null_count() const
+    {
+        return dense? nulls : sparse.null_count();
+    }
+    
+    int run_count() const
+    {
+        return dense? runs : sparse.run_count();
+    }
+    
+    std::size_t memory_bytes() const
+    {
+        return sizeof(*this) - sizeof(Sparse) + sparse.memory_bytes()
+             + detailSparseContainer::heapCapacity(values, 0) * sizeof(T)
+             + present.capacity() / 8;
+    }
+    
+    SparseStats stats() const
+    {
+        return {solid_count(), null_count(), run_count(), memory_bytes()};
+    }
+    
+    // See SparseContainer::decode.
+    std::uint64_t decode(iterator& it, int n, T** out)
+    {
+        if (!dense) return sparse.decode(it.sparse, n, out);
+        
+        std::uint64_t mask = 0;
+        for (int i = 0; i < n; ++i, ++it.dense, ++it.index)
+        {
+            bool solid = (!it.mask || (*it.mask)[it.index]);
+            out[i] = solid? &*it.dense : nullptr;
+            mask |= std::uint64_t{solid} << i;
+        }
+        return mask;
+    }
+    
+    template <typename U, typename Op>
+    U reduce(U init, Op op) const
+    {
+        if (!dense) return sparse.reduce(std::move(init), op);
+        
+        auto v = begin(values);
+        if (nulls == 0)
+        {
+            for (auto e = end(values); v != e; ++v) init = op(std::move(init), *v);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < present.size(); ++i, ++v)
+            {
+                if (present[i]) init = op(std::move(init), *v);
+            }
+        }
+        return init;
+    }
+    
+    template <typename F>
+    void transform(F f)
+    {
+        if (!dense)
+        {
+            sparse.transform(f);
+            return;
+        }
+        
+        auto v = begin(values);
+        if (nulls == 0)
+        {
+            for (auto e = end(values); v != e; ++v) *v = f(*v);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < present.size(); ++i, ++v)
+            {
+                if (present[i]) *v = f(*v);
+            }
+        }
+    }
+    
+    template <typename Pred>
+    int count_if(Pred pred) const
+    {
+        return reduce(0, [&](int n, const T& v){ return n + bool(pred(v)); });
+    }
+    
+    // See SparseContainer::export_buffers. While dense, the values are
+    // borrowed rather than copied if Container has a data().
+    ColumnBuffers<T> export_buffers() const
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Column buffers hold plain values!");
+        
+        if (!dense) return sparse.export_buffers();
+        
+        auto n = size();
+        ColumnBuffers<T> rval{n, nulls, std::vector<std::uint8_t>((n + 7) / 8), nullptr, {}};
+        for (int i = 0; i < n; ++i)
+        {
+            if (present[i]) rval.validity[i / 8] |= std::uint8_t(1u << (i % 8));
+        }
+        
+        rval.borrowed = detailSparseContainer::contiguous(values, 0);
+        if (!rval.borrowed) rval.owned.assign(begin(values), end(values));
+        return rval;
+    }
+    
+    // See SparseContainer::import_buffers.
+    static HybridContainer import_buffers(const T* values, const std::uint8_t* validity, int n)
+    {
+        HybridContainer rval;
+        rval.sparse = Sparse::import_buffers(values, validity, n);
+        rval.rebalance();
+        return rval;
+    }
+    
+    friend iterator begin(HybridContainer& in)
+    {
+        if (!in.dense) return begin(in.sparse);
+        return {begin(in.values), 0, in.nulls? &in.present : nullptr};
+    }
+
+    friend iterator end(HybridContainer& in)
+    {
+        if (!in.dense) return end(in.sparse);
+        return {end(in.values), int(in.present.size()), nullptr};
+    }
+
+    friend iterator begin(HybridContainer&& in)
+    {
+        return begin(in);
+    }
+
+    friend iterator end(HybridContainer&& in)
+    {
+        return end(in);
+    }
+
+private:
+    // Adjusts runs for index i flipping between solid and null.
+    // Turning a lone null solid removes a run, and splitting one adds a run;
+    // the reverse for turning a solid null.
+    void updateRuns(int i, int sign)
+    {
+        bool before = (i > 0 && !present[i-1]);
+        bool after  = (i+1 < int(present.size()) && !present[i+1]);
+        if (!before && !after) runs += sign;
+        else if (before && after) runs -= sign;
+    }
+    
+    void makeDense()
+    {
+        for (auto it = begin(sparse), e = end(sparse); it != e; ++it)
+        {
+            auto p = *it;
+            if (p)
+            {
+                values.emplace_back(std::move(*p));
+                present.push_back(true);
+            }
+            else
+            {
+                values.emplace_back();
+                present.push_back(false);
+            }
+        }
+        nulls = sparse.null_count();
+        runs = sparse.run_count();
+        sparse = Sparse{};
+        dense = true;
+    }
+    
+    void makeSparse()
+    {
+        auto v = begin(values);
+        for (std::size_t i = 0; i < present.size(); ++i, ++v)
+        {
+            if (present[i]) sparse.push_back(std::move(*v));
+            else sparse.push_back(nullptr);
+        }
+        values = Dense{};
+        present = std::vector<bool>{};
+        nulls = 0;
+        runs = 0;
+        dense = false;
+    }
+    
+    Sparse            sparse;
+    Dense             values;
+    std::vector<bool> present;
+    int               nulls;
+    int               runs;
+    bool              dense;
+};
+
+// One entry in a TrackedContainer's change log. Set and Reset cover the
+// elements [first, first+count), which became solid or null. Erase means
+// count elements were erased at first, each shifting the rest down.
+struct ChangeRange
+{
+    enum Kind
+    {
+        Set,
+        Reset,
+        Erase
+    };
+    
+    Kind kind;
+    int first;
+    int count;
+};
+
+// A SparseContainer that logs which indices were set, reset, or erased
+// since the last clear_changes(). Consecutive edits of the same kind are
+// merged, so the log grows with the number of edits, not the table size.
+template <template <typename> class Container, typename T>
+class TrackedContainer
+    : private SparseContainer<Container, T>
+{
+    using Base     = SparseContainer<Container, T>;
+    using BaseIter = typename Base::iterator;
+    
+public:
+    class iterator
+    {
+        friend TrackedContainer;
+    public:
+        // Read only, so every change has to go through set() or reset().
+        using value_type = T;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+
+        using const_reference = const value_type&;
+        using const_pointer = const value_type*;
+
+        iterator() = default;
+        
+        iterator(BaseIter i, int n)
+            : iter{i}
+            , index{n}
+        {}
+        
+        pointer operator*() const
+        {
+            return *iter;
+        }
+        
+        iterator& operator++()
+        {
+            ++iter;
+            ++index;
+            return *this;
+        }
+        
+        bool operator==(const iterator& in) const
+        {
+            return (iter == in.iter);
+        }
+        
+        bool operator!=(const iterator& in) const
+        {
+            return (iter != in.iter);
+        }
+        
+        int gap() const
+        {
+            return iter.gap();
+        }
+        
+        iterator& skip(int n)
+        {
+            iter.skip(n);
+            index += n;
+            return *this;
+        }
+        
+        int position() const
+        {
+            return index;
+        }
+        
+    private:
+        BaseIter iter;
+        int      index;
+    };
+    
+    using Base::size;
+    using Base::valid;
+    using Base::solid_count;
+    using Base::null_count;
+    using Base::run_count;
+    using Base::memory_bytes;
+    using Base::stats;
+    using Base::reduce;
+    using Base::count_if;
+    
+    template <typename A>
+    void push_back(A&& in)
+    {
+        record(ChangeRange::Set, size());
+        Base::push_back(std::forward<A>(in));
+    }
+    
+    void push_back(decltype(nullptr))
+    {
+        record(ChangeRange::Reset, size());
+        Base::push_back(nullptr);
+    }
+    
+    template <typename A>
+    iterator set(iterator it, A&& in)
+    {
+        record(ChangeRange::Set, it.index);
+        return {Base::set(it.iter, std::forward<A>(in)), it.index};
+    }
+    
+    iterator reset(iterator it)
+    {
+        if (*it) record(ChangeRange::Reset, it.index);
+        return {Base::reset(it.iter), it.index};
+    }
+    
+    iterator erase(iterator it)
+    {
+        record(ChangeRange::Erase, it.index);
+        return {Base::erase(it.iter), it.index};
+    }
+    
+    // Read only, like the iterators.
+    const T* get(int index) const
+    {
+        return Base::get(index);
+    }
+    
+    const std::vector<ChangeRange>& changes() const
+    {
+        return log;
+    }
+    
+    void clear_changes()
+    {
+        log.clear();
+    }
+    
+    friend iterator begin(TrackedContainer& in)
+    {
+        return {begin(static_cast<Base&>(in)), 0};
+    }
+
+    friend iterator end(TrackedContainer& in)
+    {
+        return {end(static_cast<Base&>(in)), in.size()};
+    }
+
+    friend iterator begin(TrackedContainer&& in)
+    {
+        return begin(in);
+    }
+
+    friend iterator end(TrackedContainer&& in)
+    {
+        return end(in);
+    }
+
+private:
+    void record(ChangeRange::Kind kind, int index)
+    {
+        if (!log.empty())
+        {
+            auto& last = log.back();
+            if (last.kind == kind)
+            {
+                if (kind == ChangeRange::Erase)
+                {
+                    if (last.first == index)
+                    {
+                        ++last.count;
+                        return;
+                    }
+                }
+                else if (index >= last.first && index <= last.first + last.count)
+                {
+                    if (index == last.first + last.count) ++last.count;
+                    return;
+                }
+            }
+        }
+        log.push_back({kind, index, 1});
+    }
+    
+    std::vector<ChangeRange> log;
+};
+
+// A value made of several columns that are always present together.
+// Used as one of a MultiContainer's types, its members share one run
+// stream and sit next to each other in storage, but rows still have
+// a separate pointer for each member.
+template <typename... T>
+struct ColumnGroup
+    : std::tuple<T...>
+{
+    ColumnGroup() = default;
+    
+    // Takes the members, or a tuple of them.
+    template <typename... A>
+    ColumnGroup(A&&... in)
+        : std::tuple<T...>(std::forward<A>(in)...)
+    {}
+};
+
+namespace detailMultiContainer
+{
+    template <typename T>
+    struct DereferenceType
+    {
+        using type = decltype(*T{});
+    };
+
+    template <typename T>
+    struct iteratorType
+    {
+        using type = decltype(begin(std::declval<T>()));
+    };
+    
+    template <typename T>
+    struct NullFor
+    {
+        using type = decltype(nullptr);
+    };
+    
+    template <typename T>
+    struct ConstPointer
+    {
+        using type = T;
+    };
+    
+    template <typename T>
+    struct ConstPointer<T*>
+    {
+        using type = const T*;
+    };
+    
+    template <typename T>
+    struct ConstTuple;
+    
+    template <typename... T>
+    struct ConstTuple<std::tuple<T...>>
+    {
+        using type = std::tuple<typename ConstPointer<T>::type...>;
+    };
+    
+    template <int... I>
+    struct Indices
+    {};
+    
+    template <int N, int... I>
+    struct MakeIndices
+        : MakeIndices<N-1, N-1, I...>
+    {};
+    
+    template <int... I>
+    struct MakeIndices<0, I...>
+    {
+        using type = Indices<I...>;
+    };
+    
+    // Turns a column's dereferenced iterator into the row elements it provides:
+    // just itself, or a pointer to each member of a ColumnGroup.
+    template <typename D>
+    struct Expand
+    {
+        using type = std::tuple<D>;
+        
+        SPARSE_MULTI_VEC_CONSTEXPR static type expand(D d)
+        {
+            return type{d};
+        }
+    };
+    
+    template <typename... T>
+    struct Expand<ColumnGroup<T...>*>
+    {
+        using type = std::tuple<T*...>;
+        
+        SPARSE_MULTI_VEC_CONSTEXPR static type expand(ColumnGroup<T...>* g)
+        {
+            return g? expand(*g, typename MakeIndices<sizeof...(T)>::type{}) : type{};
+        }
+        
+        template <int... I>
+        SPARSE_MULTI_VEC_CONSTEXPR static type expand(ColumnGroup<T...>& g, Indices<I...>)
+        {
+            return type{&std::get<I>(g)...};
+        }
+    };
+    
+    template <typename... D>
+    struct Flatten
+    {
+        using type = decltype(std::tuple_cat(std::declval<typename Expand<D>::type>()...));
+    };
+
+    template <typename T>
+    struct TupleSize
+    {
+        using RawType = typename std::decay<T>::type;
+        static constexpr auto value = std::tuple_size<RawType>::value;
+    };
+    
+    template <int N>
+    struct MakeBeginRecurse
+    {
+        template <typename I, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void makeBegin(I&& i, T&& t)
+        {
+            std::get<N>(i) = begin(std::get<N>(t));
+            MakeBeginRecurse<N-1>::makeBegin(i, t);
+        }
+    };
+    
+    template <>
+    struct MakeBeginRecurse<0>
+    {
+        template <typename I, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void makeBegin(I&& i, T&& t)
+        {
+            std::get<0>(i) = begin(std::get<0>(t));
+        }
+    };
+    
+    template <typename I, typename T>
+    SPARSE_MULTI_VEC_CONSTEXPR void makeBegin(I&& i, T&& t)
+    {
+        MakeBeginRecurse<TupleSize<I>::value-1>::makeBegin(i, t);
+    }
+    
+    template <int N>
+    struct MakeEndRecurse
+    {
+        template <typename I, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void makeEnd(I&& i, T&& t)
+        {
+            std::get<N>(i) = end(std::get<N>(t));
+            MakeEndRecurse<N-1>::makeEnd(i, t);
+        }
+    };
+    
+    template <>
+    struct MakeEndRecurse<0>
+    {
+        template <typename I, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void makeEnd(I&& i, T&& t)
+        {
+            std::get<0>(i) = end(std::get<0>(t));
+        }
+    };
+    
+    template <typename I, typename T>
+    SPARSE_MULTI_VEC_CONSTEXPR void makeEnd(I&& i, T&& t)
+    {
+        MakeEndRecurse<TupleSize<I>::value-1>::makeEnd(i, t);
+    }
+    
+    template <int N>
+    struct IncrementRecurse
+    {
+        template <typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void increment(T&& i)
+        {
+            ++std::get<N>(i);
+            IncrementRecurse<N-1>::increment(i);
+        }
+    };
+    
+    template <>
+    struct IncrementRecurse<0>
+    {
+        template <typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void increment(T&& i)
+        {
+            ++std::get<0>(i);
+        }
+    };
+    
+    template <typename T>
+    SPARSE_MULTI_VEC_CONSTEXPR void increment(T&& t)
+    {
+        IncrementRecurse<TupleSize<T>::value-1>::increment(t);
+    }
+    
+    template <int N>
+    struct SkipRecurse
+    {
+        template <typename T>
+        static void skip(T&& i, int n)
+        {
+            std::get<N>(i).skip(n);
+            SkipRecurse<N-1>::skip(i, n);
+        }
+    };
+    
+    template <>
+    struct SkipRecurse<0>
+    {
+        template <typename T>
+        static void skip(T&& i, int n)
+        {
+            std::get<0>(i).skip(n);
+        }
+    };
+    
+    template <typename T>
+    void skip(T&& t, int n)
+    {
+        SkipRecurse<TupleSize<T>::value-1>::skip(t, n);
+    }
+    
+    template <int N>
+    struct EraseRecurse
+    {
+        template <typename C, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void erase(C& c, const T& t, T& u)
+        {
+            std::get<N>(u) = std::get<N>(c).erase(std::get<N>(t));
+            EraseRecurse<N-1>::erase(c, t, u);
+        }
+    };
+    
+    template <>
+    struct EraseRecurse<0>
+    {
+        template <typename C, typename T>
+        SPARSE_MULTI_VEC_CONSTEXPR static void erase(C& c, const T& t, T& u)
+        {
+            std::get<0>(u) = std::get<0>(c).erase(std::get<0>(t));
+        }
+    };
+    
+    template <typename C, typename T>
+    SPARSE_MULTI_VEC_CONSTEXPR void erase(C& c, const T& t, T& u)
+    {
+        EraseRecurse<TupleSize<T>::value-1>::erase(c, t, u);
+    }
+    
+    template <int N>
+    struct AppendRecurse
+    {
+        template <typename C>
+        static void append(C& c, C& o)
+        {
+            std::get<N>(c).append(std::move(std::get<N>(o)));
+            AppendRecurse<N-1>::append(c, o);
+        }
+    };
+    
+    template <>
+    struct AppendRecurse<0>
+    {
+        template <typename C>
+        static void append(C& c, C& o)
+        {
+            std::get<0>(c).append(std::move(std::get<0>(o)));
+        }
+    };
+    
+    template <typename C>
+    void append(C& c, C& o)
+    {
+        AppendRecurse<TupleSize<C>::value-1>::append(c, o);
+    }
+    
+    template <int N>
+    struct StatsRecurse
+    {
+        template <typename C>
+        static void stats(const C& c, SparseStats& s)
+        {
+            s += std::get<N>(c).stats();
+            StatsRecurse<N-1>::stats(c, s);
+        }
+    };
+    
+    template <>
+    struct StatsRecurse<0>
+    {
+        template <typename C>
+        static void stats(const C& c, SparseStats& s)
+        {
+            s += std::get<0>(c).stats();
+        }
+    };
+    
+    template <int N>
+    struct SplitRecurse
+    {
+        template <typename C>
+        static void split(C& c, C& o, int i)
+        {
+            std::get<N>(o) = std::get<N>(c).split_at(i);
+            SplitRecurse<N-1>::split(c, o, i);
+        }
+    };
+    
+    template <>
+    struct SplitRecurse<0>
+    {
+        template <typename C>
+        static void split(C& c, C& o, int i)
+        {
+            std::get<0>(o) = std::get<0>(c).split_at(i);
+        }
+    };
+    
+    template <typename C>
+    void split(C& c, C& o, int i)
+    {
+        SplitRecurse<TupleSize<C>::value-1>::split(c, o, i);
+    }
+    
+    template <int N>
+    struct PermuteRecurse
+    {
+        template <typename C>
+        static void permute(C& c, const std::vector<int>& p, std::vector<std::thread>* threads)
+        {
+            auto& col = std::get<N>(c);
+            if (threads) threads->emplace_back([&col, &p]{ col.apply_permutation(p); });
+            else col.apply_permutation(p);
+            PermuteRecurse<N-1>::permute(c, p, threads);
+        }
+    };
+    
+    template <>
+    struct PermuteRecurse<0>
+    {
+        template <typename C>
+        static void permute(C& c, const std::vector<int>& p, std::vector<std::thread>* threads)
+        {
+            auto& col = std::get<0>(c);
+            if (threads) threads->emplace_back([&col, &p]{ col.apply_permutation(p); });
+            else col.apply_permutation(p);
+        }
+    };
+    
+    // Columns are independent, so big tables permute one column per thread.
+    template <typename C>
+    void permute(C& c, const std::vector<int>& p)
+    {
+        constexpr int parallelRows = 1 << 15;
+        
+        if (TupleSize<C>::value > 1 && p.size() >= parallelRows && std::thread::hardware_concurrency() > 1)
+        {
+            std::vector<std::thread> threads;
+            PermuteRecurse<TupleSize<C>::value-1>::permute(c, p, &threads);
+            for (auto&& t : threads) t.join();
+        }
+        else
+        {
+            PermuteRecurse<TupleSize<C>::value-1>::permute(c, p, nullptr);
+        }
+    }
+    
+    template <int N>
+    struct DecodeRecurse
+    {
+        template <typename C, typename I, typename P>
+        static void decode(C& c, I& i, int n, P& p, std::uint64_t* m)
+        {
+            m[N] = std::get<N>(c).decode(std::get<N>(i), n, std::get<N>(p).data());
+            DecodeRecurse<N-1>::decode(c, i, n, p, m);
+        }
+    };
+    
+    template <>
+    struct DecodeRecurse<0>
+    {
+        template <typename C, typename I, typename P>
+        static void decode(C& c, I& i, int n, P& p, std::uint64_t* m)
+        {
+            m[0] = std::get<0>(c).decode(std::get<0>(i), n, std::get<0>(p).data());
+        }
+    };
+    
+    template <typename C, typename I, typename P>
+    void decode(C& c, I& i, int n, P& p, std::uint64_t* m)
+    {
+        DecodeRecurse<TupleSize<C>::value-1>::decode(c, i, n, p, m);
+    }
+    
+    template <int N>
+    struct ClearChangesRecurse
+    {
+        template <typename C>
+        static void clearChanges(C& c)
+        {
+            std::get<N>(c).clear_changes();
+            ClearChangesRecurse<N-1>::clearChanges(c);
+        }
+    };
+    
+    template <>
+    struct ClearChangesRecurse<0>
+    {
+        template <typename C>
+        static void clearChanges(C& c)
+        {
+            std::get<0>(c).clear_changes();
+        }
+    };
+    
+    template <typename C>
+    void clearChanges(C& c)
+    {
+        ClearChangesRecurse<TupleSize<C>::value-1>::clearChanges(c);
+    }
+    
+    template <int N>
+    struct FromColumnsRecurse
+    {
+        template <typename C, typename I>
+        static void fromColumns(C& c, const I& in, int n, std::vector<std::thread>* threads)
+        {
+            using Column = typename std::tuple_element<N, C>::type;
+            auto& col = std::get<N>(c);
+            auto src = std::get<N>(in);
+            auto build = [&col, src, n]{ col = Column::from_column(src.values, src.mask, n); };
+            if (threads) threads->emplace_back(build);
+            else build();
+            FromColumnsRecurse<N-1>::fromColumns(c, in, n, threads);
+        }
+    };
+    
+    template <>
+    struct FromColumnsRecurse<0>
+    {
+        template <typename C, typename I>
+        static void fromColumns(C& c, const I& in, int n, std::vector<std::thread>* threads)
+        {
+            using Column = typename std::tuple_element<0, C>::type;
+            auto& col = std::get<0>(c);
+            auto src = std::get<0>(in);
+            auto build = [&col, src, n]{ col = Column::from_column(src.values, src.mask, n); };
+            if (threads) threads->emplace_back(build);
+            else build();
+        }
+    };
+    
+    template <typename C, typename I>
+    void fromColumns(C& c, const I& in, int n)
+    {
+        constexpr int parallelRows = 1 << 15;
+        
+        if (TupleSize<C>::value > 1 && n >= parallelRows && std::thread::hardware_concurrency() > 1)
+        {
+            std::vector<std::thread> threads;
+            FromColumnsRecurse<TupleSize<C>::value-1>::fromColumns(c, in, n, &threads);
+            for (auto&& t : threads) t.join();
+        }
+        else
+        {
+            FromColumnsRecurse<TupleSize<C>::value-1>::fromColumns(c, in, n, nullptr);
+        }
+    }
+    
+    template <int N>
+    struct ExportRecurse
+    {
+        template <typename C, typename B>
+        static void exportBuffers(const C& c, B& b)
+        {
+            std::get<N>(b) = std::get<N>(c).export_buffers();
+            ExportRecurse<N-1>::exportBuffers(c, b);
+        }
+        
+        template <typename C, typename B>
+        static void importBuffers(C& c, const B& b)
+        {
+            using Column = typename std::tuple_element<N, C>::type;
+            auto& in = std::get<N>(b);
+            std::get<N>(c) = Column::import_buffers(in.values(), in.validity.data(), in.length);
+            ExportRecurse<N-1>::importBuffers(c, b);
+        }
+    };
+    
+    template <>
+    struct ExportRecurse<0>
+    {
+        template <typename C, typename B>
+        static void exportBuffers(const C& c, B& b)
+        {
+            std::get<0>(b) = std::get<0>(c).export_buffers();
+        }
+        
+        template <typename C, typename B>
+        static void importBuffers(C& c, const B& b)
+        {
+            using Column = typename std::tuple_element<0, C>::type;
+            auto& in = std::get<0>(b);
+            std::get<0>(c) = Column::import_buffers(in.values(), in.validity.data(), in.length);
+        }
+    };
+    
+    template <typename C, typename B>
+    void exportBuffers(const C& c, B& b)
+    {
+        ExportRecurse<TupleSize<C>::value-1>::exportBuffers(c, b);
+    }
+    
+    template <typename C, typename B>
+    void importBuffers(C& c, const B& b)
+    {
+        ExportRecurse<TupleSize<C>::value-1>::importBuffers(c, b);
+    }
+    
+    template <int N>
+    struct DiffRecurse
+    {
+        template <typename C, typename D>
+        static void diff(const C& a, const C& b, D& d)
+        {
+            using Column = typename std::tuple_element<N, C>::type;
+            std::get<N>(d) = Column::diff(std::get<N>(a), std::get<N>(b));
+            DiffRecurse<N-1>::diff(a, b, d);
+        }
+    };
+    
+    template <>
+    struct DiffRecurse<0>
+    {
+        template <typename C, typename D>
+        static void diff(const C& a, const C& b, D& d)
+        {
+            using Column = typename std::tuple_element<0, C>::type;
+            std::get<0>(d) = Column::diff(std::get<0>(a), std::get<0>(b));
+        }
+    };
+    
+    template <typename C, typename D>
+    void diff(const C& a, const C& b, D& d)
+    {
+        DiffRecurse<TupleSize<C>::value-1>::diff(a, b, d);
+    }
+    
+    template <int N>
+    struct ApplyRecurse
+    {
+        template <typename C, typename D>
+        static void apply(C& c, const D& d)
+        {
+            std::get<N>(c).apply(std::get<N>(d));
+            ApplyRecurse<N-1>::apply(c, d);
+        }
+    };
+    
+    template <>
+    struct ApplyRecurse<0>
+    {
+        template <typename C, typename D>
+        static void apply(C& c, const D& d)
+        {
+            std::get<0>(c).apply(std::get<0>(d));
+        }
+    };
+    
+    template <typename C, typename D>
+    void apply(C& c, const D& d)
+    {
+        ApplyRecurse<TupleSize<C>::value-1>::apply(c, d);
+    }
+    
+    template <int N>
+    struct ValidRecurse
+    {
+        template <typename C>
+        static bool valid(const C& c)
+        {
+            auto& col = std::get<N>(c);
+            return col.valid() && col.size() == std::get<0>(c).size() && ValidRecurse<N-1>::valid(c);
+        }
+    };
+    
+    template <>
+    struct ValidRecurse<0>
+    {
+        template <typename C>
+        static bool valid(const C& c)
+        {
+            return std::get<0>(c).valid();
+        }
+    };
+    
+    template <typename C>
+    bool valid(const C& c)
+    {
+        return ValidRecurse<TupleSize<C>::value-1>::valid(c);
+    }
+    
+    template <typename C>
+    SparseStats stats(const C& c)
+    {
+        SparseStats rval{0, 0, 0, 0};
+        StatsRecurse<TupleSize<C>::value-1>::stats(c, rval);
+        return rval;
+    }
+
+} // namespace detailMultiContainer
+
+template <template <typename> class Container, typename... Types>
+class MultiContainer;
+
+template <typename Table, typename Filter, typename Projection>
+class Query;
+
+namespace detailQuery
+{
+    // Filter stages. reject() returns how many rows, starting at it,
+    // fail the stages so far; 0 means the row passes. Anything an iterator
+    // has to remember between rows lives in the stage's State.
+    
+    struct All
+    {
+        static constexpr bool counted = false;
+        
+        struct State {};
+        
+        template <typename I>
+        int reject(const I&, State&)
+        {
+            return 0;
+        }
+    };
+    
+    // Rejects rows where column N is null or fails pred.
+    // A null rejects the whole run of nulls at once, unless a take()
+    // before this needs to see each of those rows.
+    template <int N, typename Pred, typename Prev>
+    struct Where
+    {
+        static constexpr bool counted = Prev::counted;
+        
+        using State = typename Prev::State;
+        
+        template <typename I>
+        int reject(const I& it, State& s)
+        {
+            if (auto r = prev.reject(it, s)) return r;
+            
+            auto& col = it.template column<N>();
+            auto p = *col;
+            if (!p) return counted? 1 : col.gap();
+            return pred(*p)? 0 : 1;
+        }
+        
+        Prev prev;
+        Pred pred;
+    };
+    
+    // Passes the first n rows that get this far, and rejects the rest.
+    template <typename Prev>
+    struct Take
+    {
+        static constexpr bool counted = true;
+        
+        struct State
+        {
+            typename Prev::State prev;
+            int taken = 0;
+        };
+        
+        template <typename I>
+        int reject(const I& it, State& s)
+        {
+            if (auto r = prev.reject(it, s.prev)) return r;
+            if (s.taken == n) return std::numeric_limits<int>::max();
+            ++s.taken;
+            return 0;
+        }
+        
+        Prev prev;
+        int  n;
+    };
+    
+    struct SelectAll
+    {
+        template <typename I>
+        static auto project(I& it) -> decltype(*it)
+        {
+            return *it;
+        }
+    };
+    
+    template <int... N>
+    struct Select
+    {
+        template <typename I>
+        static auto project(const I& it) -> decltype(std::make_tuple(*it.template column<N>()...))
+        {
+            return std::make_tuple(*it.template column<N>()...);
+        }
+    };
+    
+} // namespace detailQuery
+
+template <template <typename> class Container, typename... Types>
+SPARSE_MULTI_VEC_CONSTEXPR typename MultiContainer<Container, Types...>::iterator begin(MultiContainer<Container, Types...>& in);
+
+template <template <typename> class Container, typename... Types>
+SPARSE_MULTI_VEC_CONSTEXPR typename MultiContainer<Container, Types...>::iterator end(MultiContainer<Container, Types...>& in);
+
+template <template <typename> class Container, typename... Types>
+class MultiContainer
+{
+    static_assert(sizeof...(Types) > 0, "Must have at least one type!");
+    
+    using Tuple = std::tuple<Container<Types>...>;
+    
+    template <typename A>
+    using Iter = typename detailMultiContainer::iteratorType<Container<A>>::type;
+    
+    template <typename A>
+    using Deref = typename detailMultiContainer::DereferenceType<Iter<A>>::type;
+    
+    using TupleIter = std::tuple<Iter<Types>...>;
+    
+    using TupleRef = typename detailMultiContainer::Flatten<Deref<Types>...>::type;
+    
+public:
+    class iterator
+    {
+        friend MultiContainer;
+        
+        friend iterator begin<>(MultiContainer& in);
+        friend iterator end<>(MultiContainer& in);
+        
+    public:
+        SPARSE_MULTI_VEC_CONSTEXPR TupleRef operator*()
+        {
+            return deref(typename detailMultiContainer::MakeIndices<sizeof...(Types)>::type{});
+        }
+        
+        SPARSE_MULTI_VEC_CONSTEXPR iterator& operator++()
+        {
+            detailMultiContainer::increment(iter);
+            return *this;
+        }
+        
+        SPARSE_MULTI_VEC_CONSTEXPR bool operator==(const iterator& in)
+        {
+            return (iter == in.iter);
+        }
+        
+        SPARSE_MULTI_VEC_CONSTEXPR bool operator!=(const iterator& in) const
+        {
+            return (iter != in.iter);
+        }
+        
+        template <int N>
+        const typename std::tuple_element<N, TupleIter>::type& column() const
+        {
+            return std::get<N>(iter);
+        }
+        
+        // Advances n rows, skipping whole runs in each column.
+        iterator& skip(int n)
+        {
+            detailMultiContainer::skip(iter, n);
+            return *this;
+        }
+        
+    private:
+        template <int... I>
+        SPARSE_MULTI_VEC_CONSTEXPR TupleRef deref(detailMultiContainer::Indices<I...>)
+        {
+            return std::tuple_cat(detailMultiContainer::Expand<Deref<Types>>::expand(*std::get<I>(iter))...);
+        }
+        
+        TupleIter iter;
+    };
+    
+    // Up to N consecutive rows, decoded into an array of pointers per column
+    // and a mask per column with bit i set if row i is solid there.
+    template <int N>
+    class block
+    {
+        static_assert(N > 0 && N <= 64, "Block size must be between 1 and 64!");
+        
+        friend MultiContainer;
+    public:
+        int first() const
+        {
+            return row;
+        }
+        
+        int size() const
+        {
+            return count;
+        }
+        
+        template <int C>
+        const typename std::tuple_element<C, std::tuple<std::array<Deref<Types>, N>...>>::type& column() const
+        {
+            return std::get<C>(ptrs);
+        }
+        
+        template <int C>
+        std::uint64_t mask() const
+        {
+            return masks[C];
+        }
+        
+    private:
+        int row;
+        int count;
+        std::tuple<std::array<Deref<Types>, N>...> ptrs;
+        std::uint64_t masks[sizeof...(Types)];
+    };
+    
+    template <int N>
+    class block_iterator
+    {
+        friend MultiContainer;
+    public:
+        const block<N>& operator*() const
+        {
+            return blk;
+        }
+        
+        const block<N>* operator->() const
+        {
+            return &blk;
+        }
+        
+        block_iterator& operator++()
+        {
+            blk.row += blk.count;
+            decode();
+            return *this;
+        }
+        
+        bool operator==(const block_iterator& in) const
+        {
+            return (blk.row == in.blk.row);
+        }
+        
+        bool operator!=(const block_iterator& in) const
+        {
+            return (blk.row != in.blk.row);
+        }
+        
+    private:
+        void decode()
+        {
+            blk.count = std::min(N, owner->size() - blk.row);
+            if (blk.count > 0)
+            {
+                detailMultiContainer::decode(owner->data, iter, blk.count, blk.ptrs, blk.masks);
+            }
+        }
+        
+        MultiContainer* owner;
+        TupleIter       iter;
+        block<N>        blk;
+    };
+    
+    template <int N>
+    class block_range
+    {
+        friend MultiContainer;
+    public:
+        friend block_iterator<N> begin(const block_range& in)
+        {
+            return in.owner->template block_begin<N>();
+        }
+        
+        friend block_iterator<N> end(const block_range& in)
+        {
+            return in.owner->template block_end<N>();
+        }
+        
+    private:
+        MultiContainer* owner;
+    };
+    
+    SPARSE_MULTI_VEC_CONSTEXPR MultiContainer()
+        : data{}
+    {}
+    
+    // Walks the table N rows at a time. Each column is decoded a whole block
+    // at once, so the inner loops over a block need not branch on runs.
+    template <int N = 64>
+    block_iterator<N> block_begin()
+    {
+        block_iterator<N> rval;
+        rval.owner = this;
+        detailMultiContainer::makeBegin(rval.iter, data);
+        rval.blk.row = 0;
+        rval.decode();
+        return rval;
+    }
+    
+    template <int N = 64>
+    block_iterator<N> block_end()
+    {
+        block_iterator<N> rval;
+        rval.owner = this;
+        rval.blk.row = size();
+        rval.blk.count = 0;
+        return rval;
+    }
+    
+    template <int N = 64>
+    block_range<N> blocks()
+    {
+        block_range<N> rval;
+        rval.owner = this;
+        return rval;
+    }
+    
+    template <typename... A>
+    SPARSE_MULTI_VEC_CONSTEXPR void push_back(A&&... in)
+    {
+        static_assert(sizeof...(A) == std::tuple_size<Tuple>::value, "Argument count must match container count!");
+        push_backer(std::forward<A>(in)...);
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR iterator erase(iterator it)
+    {
+        iterator rval;
+        detailMultiContainer::erase(data, it.iter, rval.iter);
+        return rval;
+    }
+    
+    // Moves all of in's rows onto the end of this container, column by column.
+    void append(MultiContainer&& in)
+    {
+        detailMultiContainer::append(data, in.data);
+    }
+    
+    // Moves the rows from index onwards into a new container.
+    // index must be in [0, size()].
+    MultiContainer split_at(int index)
+    {
+        assert(0 <= index && index <= size());
+        
+        MultiContainer rval;
+        detailMultiContainer::split(data, rval.data, index);
+        return rval;
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR int size() const
+    {
+        return std::get<0>(data).size();
+    }
+    
+    // Lazy queries. Stages are fused into a single pass over the rows,
+    // evaluated by iterating the query or calling its for_each.
+    
+    Query<MultiContainer, detailQuery::All, detailQuery::SelectAll> query()
+    {
+        return {*this, {}};
+    }
+    
+    template <int N, typename Pred>
+    auto where(Pred pred) -> decltype(query().template where<N>(pred))
+    {
+        return query().template where<N>(pred);
+    }
+    
+    template <int... N>
+    auto select() -> decltype(query().template select<N...>())
+    {
+        return query().template select<N...>();
+    }
+    
+    auto take(int n) -> decltype(query().take(n))
+    {
+        return query().take(n);
+    }
+    
+    // Reorders every column so that row i is the one that was at perm[i].
+    void apply_permutation(const std::vector<int>& perm)
+    {
+        assert(int(perm.size()) == size());
+        detailMultiContainer::permute(data, perm);
+    }
+    
+    // Stably reorders all rows by the values in column N, nulls last.
+    template <int N, typename Compare>
+    void sort_rows(Compare cmp)
+    {
+        auto& col = std::get<N>(data);
+        std::vector<Deref<typename std::tuple_element<N, std::tuple<Types...>>::type>> keys;
+        keys.reserve(size());
+        for (auto it = begin(col), e = end(col); it != e; ++it)
+        {
+            keys.push_back(*it);
+        }
+        
+        std::vector<int> perm(keys.size());
+        std::iota(begin(perm), end(perm), 0);
+        std::stable_sort(begin(perm), end(perm), [&](int a, int b)
+        {
+            auto ka = keys[a];
+            auto kb = keys[b];
+            if (!ka || !kb) return (ka && !kb);
+            return cmp(*ka, *kb);
+        });
+        
+        apply_permutation(perm);
+    }
+    
+    template <int N>
+    void sort_rows()
+    {
+        sort_rows<N>(std::less<typename std::tuple_element<N, std::tuple<Types...>>::type>{});
+    }
+    
+    // Column algorithms over the solid elements of column N.
+    
+    template <int N, typename U, typename Op>
+    U reduce(U init, Op op) const
+    {
+        return std::get<N>(data).reduce(std::move(init), op);
+    }
+    
+    template <int N, typename F>
+    void transform(F f)
+    {
+        std::get<N>(data).transform(f);
+    }
+    
+    template <int N, typename Pred>
+    int count_if(Pred pred) const
+    {
+        return std::get<N>(data).count_if(pred);
+    }
+    
+    // Totals over every column.
+    SparseStats stats() const
+    {
+        return detailMultiContainer::stats(data);
+    }
+    
+    // Every column is valid and they all have the same number of rows.
+    bool valid() const
+    {
+        return detailMultiContainer::valid(data);
+    }
+    
+    // Builds n rows from one ColumnInput per column, see SparseContainer::from_column.
+    // Big tables are built one column per thread.
+    static MultiContainer from_columns(int n, ColumnInput<Types>... in)
+    {
+        MultiContainer rval;
+        detailMultiContainer::fromColumns(rval.data, std::make_tuple(in...), n);
+        return rval;
+    }
+    
+    // One set of buffers per column, see SparseContainer::export_buffers.
+    using buffers_type = std::tuple<ColumnBuffers<Types>...>;
+    
+    buffers_type export_buffers() const
+    {
+        buffers_type rval;
+        detailMultiContainer::exportBuffers(data, rval);
+        return rval;
+    }
+    
+    static MultiContainer import_buffers(const buffers_type& in)
+    {
+        MultiContainer rval;
+        detailMultiContainer::importBuffers(rval.data, in);
+        return rval;
+    }
+    
+    // One delta per column, see SparseContainer::diff.
+    using delta_type = std::tuple<SparseDelta<Types>...>;
+    
+    static delta_type diff(const MultiContainer& prev, const MultiContainer& next)
+    {
+        delta_type rval;
+        detailMultiContainer::diff(prev.data, next.data, rval);
+        return rval;
+    }
+    
+    void apply(const delta_type& in)
+    {
+        detailMultiContainer::apply(data, in);
+    }
+    
+    // Makes column N of the row at it solid, or null, through that column's
+    // own set() and reset(), so a Tracked column logs the change.
+    // Returns an iterator to the same row.
+    template <int N, typename A>
+    iterator set(iterator it, A&& in)
+    {
+        auto& col = std::get<N>(it.iter);
+        col = std::get<N>(data).set(col, std::forward<A>(in));
+        return it;
+    }
+    
+    template <int N>
+    iterator reset(iterator it)
+    {
+        auto& col = std::get<N>(it.iter);
+        col = std::get<N>(data).reset(col);
+        return it;
+    }
+    
+    // Change log of column N, for columns that keep one.
+    template <int N>
+    const std::vector<ChangeRange>& changes() const
+    {
+        return std::get<N>(data).changes();
+    }
+    
+    void clear_changes()
+    {
+        detailMultiContainer::clearChanges(data);
+    }
+    
+    // Column N by itself, so a pass over one column steps one iterator.
+    // Different columns can be used from different threads at once,
+    // but nothing may add or remove rows from a single column.
+    template <int N>
+    typename std::tuple_element<N, Tuple>::type& column()
+    {
+        return std::get<N>(data);
+    }
+    
+    template <int N>
+    const typename std::tuple_element<N, Tuple>::type& column() const
+    {
+        return std::get<N>(data);
+    }
+    
+    template <int N>
+    const typename std::tuple_element<N, Tuple>::type::instrumentation_type& instrumentation() const
+    {
+        return std::get<N>(data).instrumentation();
+    }
+    
+    friend iterator begin<>(MultiContainer& in);
+    friend iterator end<>(MultiContainer& in);
+
+private:
+    template <int N = 0, typename A, typename... B>
+    SPARSE_MULTI_VEC_CONSTEXPR void push_backer(A&& a, B&&... o)
+    {
+        std::get<N>(data).push_back(std::forward<A>(a));
+        push_backer<N+1>(std::forward<B>(o)...);
+    }
+    
+    template <int>
+    SPARSE_MULTI_VEC_CONSTEXPR void push_backer()
+    {}
+
+    Tuple data;
+};
+
+// A filter and projection over the rows of a table, evaluated lazily.
+// Filtering on a column skips its null runs without visiting them.
+template <typename Table, typename Filter, typename Projection>
+class Query
+{
+    using TableIter = typename Table::iterator;
+    
+public:
+    using value_type = decltype(Projection::project(std::declval<TableIter&>()));
+    
+    class iterator
+    {
+    public:
+        iterator(Query* in, TableIter i, int r)
+            : q{in}
+            , it{i}
+            , row{r}
+            , state{}
+        {
+            settle();
+        }
+        
+        value_type operator*()
+        {
+            return Projection::project(it);
+        }
+        
+        iterator& operator++()
+        {
+            ++it;
+            ++row;
+            settle();
+            return *this;
+        }
+        
+        bool operator==(const iterator& in) const
+        {
+            return (row == in.row);
+        }
+        
+        bool operator!=(const iterator& in) const
+        {
+            return (row != in.row);
+        }
+        
+    private:
+        void settle()
+        {
+            auto rows = q->table->size();
+            while (row < rows)
+            {
+                auto r = q->filter.reject(it, state);
+                if (r == 0) return;
+                if (r >= rows - row) break;
+                it.skip(r);
+                row += r;
+            }
+            row = rows;
+        }
+        
+        Query*    q;
+        TableIter it;
+        int       row;
+        typename Filter::State state;
+    };
+    
+    Query(Table& t, Filter f)
+        : table{&t}
+        , filter(std::move(f))
+    {}
+    
+    template <int N, typename Pred>
+    Query<Table, detailQuery::Where<N, Pred, Filter>, Projection> where(Pred pred) const
+    {
+        return {*table, {filter, std::move(pred)}};
+    }
+    
+    template <int... N>
+    Query<Table, Filter, detailQuery::Select<N...>> select() const
+    {
+        return {*table, filter};
+    }
+    
+    // Stages run in the order they were added, so take(3).where(...)
+    // filters the first three rows, while where(...).take(3)
+    // keeps the first three rows that pass.
+    Query<Table, detailQuery::Take<Filter>, Projection> take(int n) const
+    {
+        return {*table, {filter, n}};
+    }
+    
+    template <typename F>
+    void for_each(F f)
+    {
+        for (auto it = begin(*this), e = end(*this); it != e; ++it)
+        {
+            f(*it);
+        }
+    }
+    
+    friend iterator begin(Query& in)
+    {
+        return {&in, begin(*in.table), 0};
+    }
+    
+    friend iterator end(Query& in)
+    {
+        return {&in, TableIter{}, in.table->size()};
+    }
+    
+    friend iterator begin(Query&& in)
+    {
+        return begin(in);
+    }
+    
+    friend iterator end(Query&& in)
+    {
+        return end(in);
+    }
+    
+private:
+    Table* table;
+    Filter filter;
+};
+
+template <template <typename> class Container, typename... Types>
+SPARSE_MULTI_VEC_CONSTEXPR typename MultiContainer<Container, Types...>::iterator begin(MultiContainer<Container, Types...>& in)
+{
+    typename MultiContainer<Container, Types...>::iterator rval;
+    detailMultiContainer::makeBegin(rval.iter, in.data);
+    return rval;
 }
 
+template <template <typename> class Container, typename... Types>
+SPARSE_MULTI_VEC_CONSTEXPR typename MultiContainer<Container, Types...>::iterator end(MultiContainer<Container, Types...>& in)
+{
+    typename MultiContainer<Container, Types...>::iterator rval;
+    detailMultiContainer::makeEnd(rval.iter, in.data);
+    return rval;
+}
+
+// A vector that keeps its first N elements inside the object itself,
+// and only goes to the heap once it outgrows them.
+// Has just enough of std::vector to be a Container for the classes above.
+template <typename T, std::size_t N>
+class SmallVector
+{
+    static_assert(N > 0, "Must have room for at least one element!");
+    
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using iterator = T*;
+    using const_iterator = const T*;
+    
+    SmallVector()
+        : first{local()}
+        , count{0}
+        , cap{N}
+    {}
+    
+    SmallVector(const SmallVector& in)
+        : SmallVector()
+    {
+        reserve(in.count);
+        for (auto&& v : in) emplace_back(v);
+    }
+    
+    SmallVector(SmallVector&& in)
+        : SmallVector()
+    {
+        steal(std::move(in));
+    }
+    
+    SmallVector& operator=(const SmallVector& in)
+    {
+        if (this != &in)
+        {
+            clear();
+            reserve(in.count);
+            for (auto&& v : in) emplace_back(v);
+        }
+        return *this;
+    }
+    
+    SmallVector& operator=(SmallVector&& in)
+    {
+        if (this != &in)
+        {
+            clear();
+            release();
+            steal(std::move(in));
+        }
+        return *this;
+    }
+    
+    ~SmallVector()
+    {
+        clear();
+        release();
+    }
+    
+    template <typename... A>
+    void emplace_back(A&&... in)
+    {
+        if (count == cap)
+        {
+            // The argument may live in the buffer we are about to leave.
+            T tmp(std::forward<A>(in)...);
+            grow(count + 1);
+            new (first + count) T(std::move(tmp));
+        }
+        else
+        {
+            new (first + count) T(std::forward<A>(in)...);
+        }
+        ++count;
+    }
+    
+    void push_back(const T& in)
+    {
+        emplace_back(in);
+    }
+    
+    void push_back(T&& in)
+    {
+        emplace_back(std::move(in));
+    }
+    
+    template <typename... A>
+    iterator emplace(const_iterator where, A&&... in)
+    {
+        auto i = where - first;
+        if (i == difference_type(count))
+        {
+            emplace_back(std::forward<A>(in)...);
+            return first + i;
+        }
+        
+        T tmp(std::forward<A>(in)...);
+        if (count == cap) grow(count + 1);
+        
+        new (first + count) T(std::move(first[count - 1]));
+        std::move_backward(first + i, first + count - 1, first + count);
+        first[i] = std::move(tmp);
+        ++count;
+        return first + i;
+    }
+    
+    // Constructs the new elements at the end and rotates them into place,
+    // so inserting at end() is a single uninitialized_copy.
+    template <typename I>
+    iterator insert(const_iterator where, I from, I to)
+    {
+        auto i = where - first;
+        auto n = size_type(std::distance(from, to));
+        reserve(count + n);
+        std::uninitialized_copy(from, to, first + count);
+        count += n;
+        std::rotate(first + i, first + count - n, first + count);
+        return first + i;
+    }
+    
+    iterator erase(const_iterator where)
+    {
+        return erase(where, where + 1);
+    }
+    
+    iterator erase(const_iterator from, const_iterator to)
+    {
+        auto i = from - first;
+        auto n = to - from;
+        if (n > 0)
+        {
+            std::move(first + i + n, first + count, first + i);
+            destroy(first + count - n, first + count);
+            count -= n;
+        }
+        return first + i;
+    }
+    
+    void pop_back()
+    {
+        first[--count].~T();
+    }
+    
+    void clear()
+    {
+        destroy(first, first + count);
+        count = 0;
+    }
+    
+    void reserve(size_type n)
+    {
+        if (n > cap) grow(n);
+    }
+    
+    T& operator[](size_type i) { return first[i]; }
+    const T& operator[](size_type i) const { return first[i]; }
+    
+    T& front() { return first[0]; }
+    const T& front() const { return first[0]; }
+    
+    T& back() { return first[count - 1]; }
+    const T& back() const { return first[count - 1]; }
+    
+    T* data() { return first; }
+    const T* data() const { return first; }
+    
+    size_type size() const
+    {
+        return count;
+    }
+    
+    bool empty() const
+    {
+        return count == 0;
+    }
+    
+    size_type capacity() const
+    {
+        return cap;
+    }
+    
+    // True while the elements are still in the inline buffer.
+    bool is_inline() const
+    {
+        return first == local();
+    }
+    
+    friend iterator begin(SmallVector& in) { return in.first; }
+    friend iterator end(SmallVector& in) { return in.first + in.count; }
+    friend const_iterator begin(const SmallVector& in) { return in.first; }
+    friend const_iterator end(const SmallVector& in) { return in.first + in.count; }
+    
+private:
+    T* local()
+    {
+        return reinterpret_cast<T*>(&buffer);
+    }
+    
+    const T* local() const
+    {
+        return reinterpret_cast<const T*>(&buffer);
+    }
+    
+    static void destroy(T* from, T* to)
+    {
+        for (; from != to; ++from) from->~T();
+    }
+    
+    // Moves [from, to) into raw storage at out, ending their lifetimes.
+    // Trivially copyable elements are copied in one go.
+    static void relocate(T* from, T* to, T* out, std::true_type)
+    {
+        if (from != to) std::memcpy(static_cast<void*>(out), from, (to - from) * sizeof(T));
+    }
+    
+    static void relocate(T* from, T* to, T* out, std::false_type)
+    {
+        for (; from != to; ++from, ++out)
+        {
+            new (out) T(std::move(*from));
+            from->~T();
+        }
+    }
+    
+    static void relocate(T* from, T* to, T* out)
+    {
+        relocate(from, to, out, std::is_trivially_copyable<T>{});
+    }
+    
+    void grow(size_type n)
+    {
+        n = std::max(n, cap * 2);
+        auto next = static_cast<T*>(::operator new(n * sizeof(T)));
+        relocate(first, first + count, next);
+        release();
+        first = next;
+        cap = n;
+    }
+    
+    // Frees the heap buffer, if any. The elements must already be gone.
+    void release()
+    {
+        if (!is_inline()) ::operator delete(first);
+        first = local();
+        cap = N;
+    }
+    
+    // Takes in's elements, which must be empty here.
+    void steal(SmallVector&& in)
+    {
+        if (in.is_inline())
+        {
+            relocate(in.first, in.first + in.count, first);
+            count = in.count;
+            in.count = 0;
+        }
+        else
+        {
+            first = in.first;
+            count = in.count;
+            cap = in.cap;
+            in.first = in.local();
+            in.count = 0;
+            in.cap = N;
+        }
+    }
+    
+    typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type buffer;
+    T* first;
+    size_type count;
+    size_type cap;
+};
+
+// Makes SmallVector<T, N> fit a Container parameter.
+template <std::size_t N>
+struct InlineStorage
+{
+    template <typename T>
+    using type = SmallVector<T, N>;
+};
+
+// A vector with room for exactly N elements, all of them inside the object.
+// Never allocates; running out of room is a bug and asserts.
+// Elements past size() stay constructed, so T must be default constructible.
+template <typename T, std::size_t N>
+class FixedVector
+{
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using iterator = T*;
+    using const_iterator = const T*;
+    
+    constexpr FixedVector()
+        : items{}
+        , count{0}
+    {}
+    
+    template <typename... A>
+    SPARSE_MULTI_VEC_CONSTEXPR void emplace_back(A&&... in)
+    {
+        assert(count < N);
+        items[count] = T(std::forward<A>(in)...);
+        ++count;
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR void push_back(const T& in)
+    {
+        emplace_back(in);
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR void push_back(T&& in)
+    {
+        emplace_back(std::move(in));
+    }
+    
+    template <typename... A>
+    SPARSE_MULTI_VEC_CONSTEXPR iterator emplace(const_iterator where, A&&... in)
+    {
+        assert(count < N);
+        auto i = where - items.data();
+        T tmp(std::forward<A>(in)...);
+        for (auto j = difference_type(count); j > i; --j)
+        {
+            items[j] = std::move(items[j - 1]);
+        }
+        items[i] = std::move(tmp);
+        ++count;
+        return items.data() + i;
+    }
+    
+    template <typename I>
+    SPARSE_MULTI_VEC_CONSTEXPR iterator insert(const_iterator where, I from, I to)
+    {
+        auto i = size_type(where - items.data());
+        auto n = size_type(std::distance(from, to));
+        assert(count + n <= N);
+        for (auto j = count; j > i; --j)
+        {
+            items[j - 1 + n] = std::move(items[j - 1]);
+        }
+        for (auto j = i; from != to; ++from, ++j)
+        {
+            items[j] = *from;
+        }
+        count += n;
+        return items.data() + i;
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR iterator erase(const_iterator where)
+    {
+        return erase(where, where + 1);
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR iterator erase(const_iterator from, const_iterator to)
+    {
+        auto i = from - items.data();
+        auto n = to - from;
+        for (auto j = size_type(i + n); j < count; ++j)
+        {
+            items[j - n] = std::move(items[j]);
+        }
+        for (auto j = count - n; j < count; ++j)
+        {
+            items[j] = T{};
+        }
+        count -= n;
+        return items.data() + i;
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR void pop_back()
+    {
+        items[--count] = T{};
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR void clear()
+    {
+        erase(items.data(), items.data() + count);
+    }
+    
+    void reserve(size_type n)
+    {
+        assert(n <= N);
+        (void)n;
+    }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR T& operator[](size_type i) { return items[i]; }
+    constexpr const T& operator[](size_type i) const { return items[i]; }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR T& front() { return items[0]; }
+    constexpr const T& front() const { return items[0]; }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR T& back() { return items[count - 1]; }
+    constexpr const T& back() const { return items[count - 1]; }
+    
+    SPARSE_MULTI_VEC_CONSTEXPR T* data() { return items.data(); }
+    SPARSE_MULTI_VEC_CONSTEXPR const T* data() const { return items.data(); }
+    
+    constexpr size_type size() const
+    {
+        return count;
+    }
+    
+    constexpr bool empty() const
+    {
+        return count == 0;
+    }
+    
+    constexpr size_type capacity() const
+    {
+        return N;
+    }
+    
+    // The elements never leave the object.
+    constexpr bool is_inline() const
+    {
+        return true;
+    }
+    
+    friend SPARSE_MULTI_VEC_CONSTEXPR iterator begin(FixedVector& in) { return in.items.data(); }
+    friend SPARSE_MULTI_VEC_CONSTEXPR iterator end(FixedVector& in) { return in.items.data() + in.count; }
+    friend SPARSE_MULTI_VEC_CONSTEXPR const_iterator begin(const FixedVector& in) { return in.items.data(); }
+    friend SPARSE_MULTI_VEC_CONSTEXPR const_iterator end(const FixedVector& in) { return in.items.data() + in.count; }
+    
+private:
+    std::array<T, N> items;
+    size_type count;
+};
+
+// Makes FixedVector<T, N> fit a Container parameter.
+template <std::size_t N>
+struct FixedStorage
+{
+    template <typename T>
+    using type = FixedVector<T, N>;
+};
+
 struct detailSparseMultiVec
 {
     template <typename T>
@@ -493,9 +3549,408 @@ struct detailSparseMultiVec
     
     template <typename... P>
     using SparseMultiVec = MultiContainer<SparseVec, Decay<P>...>;
+    
+    template <typename I>
+    struct Instrumented
+    {
+        template <typename T>
+        using SparseVec = SparseContainer<Vec, T, I>;
+    };
+    
+    template <typename I, typename... P>
+    using InstrumentedSparseMultiVec = MultiContainer<Instrumented<I>::template SparseVec, Decay<P>...>;
+    
+    template <typename T>
+    using HybridVec = HybridContainer<Vec, T>;
+    
+    template <typename T>
+    using TrackedVec = TrackedContainer<Vec, T>;
+    
+    template <typename... P>
+    using TrackedSparseMultiVec = MultiContainer<TrackedVec, Decay<P>...>;
+    
+    template <typename... P>
+    using HybridSparseMultiVec = MultiContainer<HybridVec, Decay<P>...>;
+    
+    template <std::size_t N>
+    struct Small
+    {
+        template <typename T>
+        using SparseVec = SparseContainer<InlineStorage<N>::template type, T>;
+    };
+    
+    template <std::size_t N, typename... P>
+    using SmallSparseMultiVec = MultiContainer<Small<N>::template SparseVec, Decay<P>...>;
+    
+    template <std::size_t N>
+    struct Fixed
+    {
+        template <typename T>
+        using SparseVec = SparseContainer<FixedStorage<N>::template type, T>;
+    };
+    
+    template <std::size_t N, typename... P>
+    using FixedSparseMultiVec = MultiContainer<Fixed<N>::template SparseVec, Decay<P>...>;
 };
 
 template <typename... P>
 using SparseMultiVec = detailSparseMultiVec::SparseMultiVec<P...>;
 
+template <typename Instrumentation, typename... P>
+using InstrumentedSparseMultiVec = detailSparseMultiVec::InstrumentedSparseMultiVec<Instrumentation, P...>;
+
+template <typename... P>
+using HybridSparseMultiVec = detailSparseMultiVec::HybridSparseMultiVec<P...>;
+
+template <typename... P>
+using TrackedSparseMultiVec = detailSparseMultiVec::TrackedSparseMultiVec<P...>;
+
+template <std::size_t N, typename... P>
+using SmallSparseMultiVec = detailSparseMultiVec::SmallSparseMultiVec<N, P...>;
+
+template <std::size_t N, typename... P>
+using FixedSparseMultiVec = detailSparseMultiVec::FixedSparseMultiVec<N, P...>;
+
+template <typename Table>
+class ConcurrentAppender;
+
+// Lets many producer threads append rows to one MultiContainer.
+// Each producer reserves a range of rows, fills a private Chunk,
+// and submits it; a single consumer calls publish() to splice
+// every contiguous submitted chunk onto the end of the table.
+template <template <typename> class Container, typename... Types>
+class ConcurrentAppender<MultiContainer<Container, Types...>>
+{
+public:
+    using Table = MultiContainer<Container, Types...>;
+    
+    class Chunk
+    {
+        friend ConcurrentAppender;
+    public:
+        int first() const
+        {
+            return base;
+        }
+        
+        int capacity() const
+        {
+            return count;
+        }
+        
+        // Refuses the row, and returns false, once the chunk is full.
+        template <typename... A>
+        bool push_back(A&&... in)
+        {
+            if (rows.size() >= count) return false;
+            rows.push_back(std::forward<A>(in)...);
+            return true;
+        }
+        
+    private:
+        Chunk(int b, int c)
+            : base{b}
+            , count{c}
+            , rows{}
+            , next{nullptr}
+        {}
+        
+        int    base;
+        int    count;
+        Table  rows;
+        Chunk* next;
+    };
+    
+    // Dropping a chunk without submitting it submits it empty,
+    // so publish() doesn't wait for its rows forever.
+    // Chunks must not outlive the appender.
+    struct Abandon
+    {
+        ConcurrentAppender* owner;
+        
+        void operator()(Chunk* c) const
+        {
+            c->rows = Table{};
+            owner->push(c);
+        }
+    };
+    
+    using ChunkPtr = std::unique_ptr<Chunk, Abandon>;
+    
+    explicit ConcurrentAppender(Table& t)
+        : table(t)
+        , reserved{t.size()}
+        , published{t.size()}
+        , head{nullptr}
+        , pending{}
+    {}
+    
+    ConcurrentAppender(const ConcurrentAppender&) = delete;
+    ConcurrentAppender& operator=(const ConcurrentAppender&) = delete;
+    
+    ~ConcurrentAppender()
+    {
+        auto p = head.exchange(nullptr);
+        while (p)
+        {
+            std::unique_ptr<Chunk> c{p};
+            p = p->next;
+        }
+    }
+    
+    // Thread-safe. Claims the next n rows of the table.
+    ChunkPtr reserve(int n)
+    {
+        auto b = reserved.fetch_add(n, std::memory_order_relaxed);
+        return ChunkPtr{new Chunk{b, n}, Abandon{this}};
+    }
+    
+    // Thread-safe and lock-free. Rows the producer did not fill are null.
+    void submit(ChunkPtr c)
+    {
+        push(c.release());
+    }
+    
+    // Consumer only. Appends submitted chunks to the table in row order,
+    // stopping at the first reserved range that has not been submitted yet.
+    // Returns the number of rows appended.
+    int publish()
+    {
+        auto p = head.exchange(nullptr, std::memory_order_acquire);
+        while (p)
+        {
+            pending.emplace_back(p);
+            p = p->next;
+        }
+        
+        std::sort(begin(pending), end(pending),
+            [](const std::unique_ptr<Chunk>& a, const std::unique_ptr<Chunk>& b)
+            {
+                return a->base < b->base;
+            });
+        
+        auto start = published;
+        auto it = begin(pending);
+        
+        for (; it != end(pending) && (*it)->base == published; ++it)
+        {
+            auto& c = **it;
+            while (c.rows.size() < c.count)
+            {
+                c.rows.push_back(typename detailMultiContainer::NullFor<Types>::type{}...);
+            }
+            table.append(std::move(c.rows));
+            published += c.count;
+        }
+        
+        pending.erase(begin(pending), it);
+        
+        return published - start;
+    }
+    
+private:
+    void push(Chunk* p)
+    {
+        p->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(p->next, p,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+        {}
+    }
+    
+    Table&                              table;
+    std::atomic<int>                    reserved;
+    int                                 published;
+    std::atomic<Chunk*>                 head;
+    std::vector<std::unique_ptr<Chunk>> pending;
+};
+
+template <typename Table>
+class VersionedTable;
+
+// A MultiContainer split into fixed-size chunks that are shared between
+// versions. The single writer mutates its own working version, copying a
+// chunk only when a published snapshot still refers to it. Readers on any
+// thread take a Snapshot of the last published version, which is cheap and
+// never changes underneath them. Old chunks are freed when the last version
+// referring to them goes away.
+template <template <typename> class Container, typename... Types>
+class VersionedTable<MultiContainer<Container, Types...>>
+{
+public:
+    using Table = MultiContainer<Container, Types...>;
+    
+private:
+    using TableIter = typename Table::iterator;
+    using Row       = typename detailMultiContainer::DereferenceType<TableIter>::type;
+    
+    struct Version
+    {
+        std::vector<std::shared_ptr<Table>> chunks;
+        int rows;
+    };
+    
+public:
+    class Snapshot
+    {
+        friend VersionedTable;
+    public:
+        class iterator
+        {
+        public:
+            using value_type = typename detailMultiContainer::ConstTuple<Row>::type;
+            
+            iterator() = default;
+            
+            iterator(const Version* v, std::size_t c)
+                : ver{v}
+                , chunk{c}
+                , row{}
+                , last{}
+            {
+                settle();
+            }
+            
+            value_type operator*()
+            {
+                return *row;
+            }
+            
+            iterator& operator++()
+            {
+                if (++row == last)
+                {
+                    ++chunk;
+                    settle();
+                }
+                return *this;
+            }
+            
+            bool operator==(const iterator& in) const
+            {
+                return (chunk == in.chunk && (chunk == ver->chunks.size() || !(row != in.row)));
+            }
+            
+            bool operator!=(const iterator& in) const
+            {
+                return !(*this == in);
+            }
+            
+        private:
+            void settle()
+            {
+                for (; chunk != ver->chunks.size(); ++chunk)
+                {
+                    auto& t = *ver->chunks[chunk];
+                    row  = begin(t);
+                    last = end(t);
+                    if (row != last) break;
+                }
+            }
+            
+            const Version* ver;
+            std::size_t    chunk;
+            TableIter      row;
+            TableIter      last;
+        };
+        
+        int size() const
+        {
+            return ver->rows;
+        }
+        
+        friend iterator begin(const Snapshot& in)
+        {
+            return {in.ver.get(), 0};
+        }
+        
+        friend iterator end(const Snapshot& in)
+        {
+            return {in.ver.get(), in.ver->chunks.size()};
+        }
+        
+    private:
+        explicit Snapshot(std::shared_ptr<const Version> v)
+            : ver{std::move(v)}
+        {}
+        
+        std::shared_ptr<const Version> ver;
+    };
+    
+    explicit VersionedTable(int chunkRows = 1024)
+        : chunkRows{chunkRows}
+        , work{}
+        , current{std::make_shared<Version>()}
+    {
+        work.rows = 0;
+    }
+    
+    // Writer only.
+    template <typename... A>
+    void push_back(A&&... in)
+    {
+        if (work.chunks.empty() || work.chunks.back()->size() >= chunkRows)
+        {
+            work.chunks.push_back(std::make_shared<Table>());
+        }
+        writable(work.chunks.size() - 1).push_back(std::forward<A>(in)...);
+        ++work.rows;
+    }
+    
+    // Writer only.
+    void erase(int row)
+    {
+        std::size_t c = 0;
+        while (row >= work.chunks[c]->size())
+        {
+            row -= work.chunks[c]->size();
+            ++c;
+        }
+        
+        auto& t = writable(c);
+        auto it = begin(t);
+        while (row-- > 0) ++it;
+        t.erase(it);
+        --work.rows;
+        
+        if (t.size() == 0)
+        {
+            work.chunks.erase(begin(work.chunks) + c);
+        }
+    }
+    
+    int size() const
+    {
+        return work.rows;
+    }
+    
+    // Writer only. Makes everything written so far visible to snapshot().
+    void publish()
+    {
+        std::shared_ptr<const Version> v = std::make_shared<Version>(work);
+        std::atomic_store(&current, v);
+    }
+    
+    // Thread-safe.
+    Snapshot snapshot() const
+    {
+        return Snapshot{std::atomic_load(&current)};
+    }
+    
+private:
+    Table& writable(std::size_t c)
+    {
+        auto& p = work.chunks[c];
+        if (p.use_count() > 1)
+        {
+            p = std::make_shared<Table>(*p);
+        }
+        return *p;
+    }
+    
+    int                            chunkRows;
+    Version                        work;
+    std::shared_ptr<const Version> current;
+};
+
 #endif //SPARSE_MULTI_VEC_HPP
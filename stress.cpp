@@ -0,0 +1,337 @@
+/*******************************************************************************
+ * SparseMultiVec - A weird container.
+ * Version: 0.0.1
+ * https://github.com/dbralir/sparse-multi-vec
+ *
+ * Copyright (c) 2013 Jeramy Harrison <dbralir@gmail.com>
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *  3. This notice may not be removed or altered from any source distribution.
+ *
+ ******************************************************************************/
+
+// Runs a long random sequence of operations against the sparse, Hybrid
+// and Small tables and against a plain vector of optionals per column,
+// checking that they agree and that valid() holds after every operation.
+// Then times the same sequence on each without the checks.
+// Needs C++17 for std::optional:
+// g++ -std=c++17 -O2 stress.cpp && ./a.out [ops] [seed]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sparsemultivec.hpp"
+
+using namespace std;
+
+struct Model
+{
+    vector<optional<int>> ints;
+    vector<optional<string>> strings;
+    
+    int size() const
+    {
+        return int(ints.size());
+    }
+};
+
+enum class Kind { Push, Erase, Set, Reset, Get, Split, Append };
+
+// where is reduced modulo the size at the time the op runs.
+struct Op
+{
+    Kind kind;
+    unsigned where;
+    int value;
+};
+
+// Pushes turn into splits past this, so erase and get stay cheap
+// and the tables keep churning instead of growing.
+const int maxRows = 256;
+
+// The low two bits of an op's value say which columns are null.
+bool intIsNull(int v) { return v & 1; }
+bool stringIsNull(int v) { return v & 2; }
+
+// The ops alternate between phases of this length. In a patchy phase
+// about half of everything pushed is null; in a solid phase only about
+// 2% is and resets are rare, so Hybrid columns fill up and go dense,
+// then thin out and go sparse again in the next patchy phase.
+const int phaseOps = 50000;
+
+vector<Op> makeOps(int n, unsigned seed)
+{
+    mt19937 rng{seed};
+    uniform_int_distribution<int> percent{0, 99};
+    uniform_int_distribution<int> value{0, 1 << 20};
+    
+    vector<Op> ops;
+    ops.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+        auto solid = (i / phaseOps) % 2 == 1;
+        
+        auto p = percent(rng);
+        auto kind = p < 45? Kind::Push
+                  : p < 57? Kind::Erase
+                  : p < 69? Kind::Set
+                  : p < 77? Kind::Reset
+                  : p < 92? Kind::Get
+                  : p < 93? Kind::Split
+                  : Kind::Append;
+        if (solid && kind == Kind::Reset && percent(rng) >= 10) kind = Kind::Set;
+        
+        auto v = value(rng);
+        if (solid)
+        {
+            v &= ~3;
+            if (percent(rng) < 2) v |= 1;
+            if (percent(rng) < 2) v |= 2;
+        }
+        
+        ops.push_back({kind, unsigned(rng()), v});
+    }
+    return ops;
+}
+
+template <typename Table>
+typename Table::iterator rowAt(Table& t, int index)
+{
+    auto it = begin(t);
+    for (int i = 0; i < index; ++i) ++it;
+    return it;
+}
+
+template <typename Table>
+long long run(Table& t, Table& spare, const Op& op)
+{
+    auto n = t.size();
+    auto kind = (op.kind == Kind::Push && n >= maxRows)? Kind::Split : op.kind;
+    auto v = op.value;
+    
+    switch (kind)
+    {
+    case Kind::Push:
+        if (intIsNull(v) && stringIsNull(v)) t.push_back(nullptr, nullptr);
+        else if (intIsNull(v)) t.push_back(nullptr, to_string(v));
+        else if (stringIsNull(v)) t.push_back(v, nullptr);
+        else t.push_back(v, to_string(v));
+        break;
+    case Kind::Erase:
+        if (n > 0) t.erase(rowAt(t, op.where % n));
+        break;
+    case Kind::Set:
+        if (n == 0) break;
+        if (v & 4) t.template set<0>(rowAt(t, op.where % n), v);
+        else t.template set<1>(rowAt(t, op.where % n), to_string(v));
+        break;
+    case Kind::Reset:
+        if (n == 0) break;
+        if (v & 4) t.template reset<0>(rowAt(t, op.where % n));
+        else t.template reset<1>(rowAt(t, op.where % n));
+        break;
+    case Kind::Get:
+    {
+        if (n == 0) return -1;
+        auto i = int(op.where % n);
+        auto a = t.template column<0>().get(i);
+        auto b = t.template column<1>().get(i);
+        return (a? *a : -1) * 31 + (b? int(b->size()) : -1);
+    }
+    case Kind::Split:
+        spare = t.split_at(op.where % (n + 1));
+        break;
+    case Kind::Append:
+        t.append(move(spare));
+        break;
+    }
+    return 0;
+}
+
+long long run(Model& m, Model& spare, const Op& op)
+{
+    auto n = m.size();
+    auto kind = (op.kind == Kind::Push && n >= maxRows)? Kind::Split : op.kind;
+    auto v = op.value;
+    
+    switch (kind)
+    {
+    case Kind::Push:
+        if (intIsNull(v)) m.ints.emplace_back();
+        else m.ints.emplace_back(v);
+        if (stringIsNull(v)) m.strings.emplace_back();
+        else m.strings.emplace_back(to_string(v));
+        break;
+    case Kind::Erase:
+        if (n == 0) break;
+        m.ints.erase(m.ints.begin() + op.where % n);
+        m.strings.erase(m.strings.begin() + op.where % n);
+        break;
+    case Kind::Set:
+        if (n == 0) break;
+        if (v & 4) m.ints[op.where % n] = v;
+        else m.strings[op.where % n] = to_string(v);
+        break;
+    case Kind::Reset:
+        if (n == 0) break;
+        if (v & 4) m.ints[op.where % n].reset();
+        else m.strings[op.where % n].reset();
+        break;
+    case Kind::Get:
+    {
+        if (n == 0) return -1;
+        auto& a = m.ints[op.where % n];
+        auto& b = m.strings[op.where % n];
+        return (a? *a : -1) * 31 + (b? int(b->size()) : -1);
+    }
+    case Kind::Split:
+    {
+        auto i = op.where % (n + 1);
+        spare.ints.assign(make_move_iterator(m.ints.begin() + i), make_move_iterator(m.ints.end()));
+        spare.strings.assign(make_move_iterator(m.strings.begin() + i), make_move_iterator(m.strings.end()));
+        m.ints.resize(i);
+        m.strings.resize(i);
+        break;
+    }
+    case Kind::Append:
+        m.ints.insert(m.ints.end(), make_move_iterator(spare.ints.begin()), make_move_iterator(spare.ints.end()));
+        m.strings.insert(m.strings.end(), make_move_iterator(spare.strings.begin()), make_move_iterator(spare.strings.end()));
+        spare = Model{};
+        break;
+    }
+    return 0;
+}
+
+template <typename Table>
+bool same(Table& t, const Model& m)
+{
+    if (t.size() != m.size()) return false;
+    
+    int i = 0;
+    for (auto&& r : t)
+    {
+        auto a = get<0>(r);
+        auto b = get<1>(r);
+        auto& ma = m.ints[i];
+        auto& mb = m.strings[i];
+        if (bool(a) != bool(ma) || (a && *a != *ma)) return false;
+        if (bool(b) != bool(mb) || (b && *b != *mb)) return false;
+        ++i;
+    }
+    return true;
+}
+
+void fail(const string& name, long i, const Op& op, const string& what)
+{
+    cout << name << " FAIL at op " << i << " (kind " << int(op.kind) << "): " << what << endl;
+    exit(1);
+}
+
+template <typename Column>
+auto isDense(const Column& c, int) -> decltype(c.is_dense())
+{
+    return c.is_dense();
+}
+
+template <typename Column>
+bool isDense(const Column&, long)
+{
+    return false;
+}
+
+// Every op is checked against the model; the full contents
+// are compared every so often, since that walks every row.
+// Returns how many times a column switched between sparse and dense.
+template <typename Table>
+long checked(const string& name, const vector<Op>& ops)
+{
+    Table t, tSpare;
+    Model m, mSpare;
+    
+    long switches = 0;
+    bool dense[] = {false, false};
+    
+    for (long i = 0; i < long(ops.size()); ++i)
+    {
+        auto& op = ops[i];
+        if (run(t, tSpare, op) != run(m, mSpare, op)) fail(name, i, op, "get");
+        if (!t.valid() || !tSpare.valid()) fail(name, i, op, "valid");
+        if (t.size() != m.size() || tSpare.size() != mSpare.size()) fail(name, i, op, "size");
+        if (i % 64 == 0 && !(same(t, m) && same(tSpare, mSpare))) fail(name, i, op, "contents");
+        
+        bool now[] = {isDense(t.template column<0>(), 0), isDense(t.template column<1>(), 0)};
+        switches += (now[0] != dense[0]) + (now[1] != dense[1]);
+        dense[0] = now[0];
+        dense[1] = now[1];
+    }
+    if (!(same(t, m) && same(tSpare, mSpare))) fail(name, long(ops.size()), ops.back(), "final contents");
+    
+    return switches;
+}
+
+template <typename C>
+double timed(const vector<Op>& ops, long long& sink)
+{
+    C c, spare;
+    auto start = chrono::steady_clock::now();
+    for (auto&& op : ops) sink += run(c, spare, op);
+    sink += c.size();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void report(const string& what, double ms)
+{
+    cout << what << "\t" << ms << " ms" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    int n = (argc > 1)? atoi(argv[1]) : 4000000;
+    unsigned seed = (argc > 2)? unsigned(atoi(argv[2])) : 1;
+    
+    auto ops = makeOps(n, seed);
+    
+    checked<SparseMultiVec<int, string>>("sparse", ops);
+    auto switches = checked<HybridSparseMultiVec<int, string>>("hybrid", ops);
+    checked<SmallSparseMultiVec<8, int, string>>("small", ops);
+    cout << n << " ops checked" << endl;
+    
+    // Otherwise the Hybrid run only tested the sparse side again.
+    if (n >= 2 * phaseOps && switches < 2)
+    {
+        cout << "hybrid FAIL: never went dense and back" << endl;
+        return 1;
+    }
+    cout << "hybrid switched " << switches << " times" << endl;
+    
+    long long modelSink = 0;
+    report("model", timed<Model>(ops, modelSink));
+    
+    long long sink = 0;
+    report("sparse", timed<SparseMultiVec<int, string>>(ops, sink));
+    report("hybrid", timed<HybridSparseMultiVec<int, string>>(ops, sink));
+    report("small", timed<SmallSparseMultiVec<8, int, string>>(ops, sink));
+    if (sink != 3 * modelSink) fail("timed", n, ops.back(), "runs disagree");
+    
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*******************************************************************************
+ * SparseMultiVec - A weird container.
+ * Version: 0.0.1
+ * https://github.com/dbralir/sparse-multi-vec
+ *
+ * Copyright (c) 2013 Jeramy Harrison <dbralir@gmail.com>
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *  1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *  2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *  3. This notice may not be removed or altered from any source distribution.
+ *
+ ******************************************************************************/
+
+// Checks that export_buffers agrees with plain row iteration,
+// read back the way an Arrow consumer would,
+// and that import_buffers brings the same rows back.
+// g++ -std=c++11 test.cpp && ./a.out
+
+#include <iostream>
+#include <string>
+
+#include "sparsemultivec.hpp"
+
+using namespace std;
+
+int failures = 0;
+
+void check(bool ok, const string& what)
+{
+    if (ok) return;
+    cout << "FAIL " << what << endl;
+    ++failures;
+}
+
+// A minimal reader: only looks at the validity bits and values().
+template <typename T>
+bool rowIsValid(const ColumnBuffers<T>& b, int i)
+{
+    return (b.validity[i / 8] >> (i % 8)) & 1;
+}
+
+template <int N, typename Table, typename Buffers>
+void compareColumn(const string& name, Table& table, const Buffers& buffers)
+{
+    auto& b = get<N>(buffers);
+    auto what = name + " column " + to_string(N);
+    
+    check(b.length == table.size(), what + " length");
+    check(b.validity.size() == size_t((b.length + 7) / 8), what + " validity size");
+    
+    int i = 0;
+    int nulls = 0;
+    for (auto&& r : table)
+    {
+        auto p = get<N>(r);
+        check(bool(p) == rowIsValid(b, i), what + " validity at " + to_string(i));
+        if (p && rowIsValid(b, i)) check(*p == b.values()[i], what + " value at " + to_string(i));
+        nulls += !p;
+        ++i;
+    }
+    check(i == b.length, what + " row count");
+    check(nulls == b.null_count, what + " null count");
+}
+
+template <typename Table>
+void compare(const string& name, Table& table)
+{
+    auto buffers = table.export_buffers();
+    compareColumn<0>(name, table, buffers);
+    compareColumn<1>(name, table, buffers);
+}
+
+// Runs of solids and nulls that don't line up with bytes or words.
+template <typename Table>
+Table runs(int rows)
+{
+    Table table;
+    for (int i = 0; i < rows; ++i)
+    {
+        if (i % 13 < 5) table.push_back(i, nullptr);
+        else if (i % 13 < 9) table.push_back(nullptr, i * 0.5);
+        else table.push_back(nullptr, nullptr);
+    }
+    return table;
+}
+
+// Whole 64-row words that are all null, all solid, and mixed,
+// so import_buffers takes each of its word-at-a-time branches.
+template <typename Table>
+Table words(int rows)
+{
+    Table table;
+    for (int i = 0; i < rows; ++i)
+    {
+        auto word = (i / 64) % 3;
+        if (word == 0) table.push_back(nullptr, i * 0.5);
+        else if (word == 1) table.push_back(i, nullptr);
+        else if (i % 3) table.push_back(i, i * 0.5);
+        else table.push_back(nullptr, nullptr);
+    }
+    return table;
+}
+
+template <typename Table>
+bool sameRows(Table& a, Table& b)
+{
+    if (a.size() != b.size()) return false;
+    
+    auto j = begin(b);
+    for (auto&& r : a)
+    {
+        auto s = *j;
+        ++j;
+        
+        auto a0 = get<0>(r), b0 = get<0>(s);
+        auto a1 = get<1>(r), b1 = get<1>(s);
+        if (bool(a0) != bool(b0) || (a0 && *a0 != *b0)) return false;
+        if (bool(a1) != bool(b1) || (a1 && *a1 != *b1)) return false;
+    }
+    return true;
+}
+
+template <typename Table>
+void roundTrip(const string& name, Table& table)
+{
+    auto back = Table::import_buffers(table.export_buffers());
+    check(back.valid(), name + " import is valid");
+    check(sameRows(table, back), name + " import has the same rows");
+}
+
+template <typename Table>
+void both(const string& name, Table table)
+{
+    compare(name, table);
+    roundTrip(name, table);
+}
+
+int main()
+{
+    for (int rows : {0, 1, 63, 64, 65, 128, 191, 192, 1000, 4097})
+    {
+        auto n = " " + to_string(rows);
+        both("sparse runs" + n, runs<SparseMultiVec<int, double>>(rows));
+        both("hybrid runs" + n, runs<HybridSparseMultiVec<int, double>>(rows));
+        both("sparse words" + n, words<SparseMultiVec<int, double>>(rows));
+        both("hybrid words" + n, words<HybridSparseMultiVec<int, double>>(rows));
+    }
+    
+    // Column 0 is all solid, so a Hybrid Container keeps it dense
+    // and exports it without copying.
+    HybridSparseMultiVec<int, double> dense;
+    for (int i = 0; i < 1001; ++i)
+    {
+        if (i % 10) dense.push_back(i, nullptr);
+        else dense.push_back(i, i * 0.5);
+    }
+    check(get<0>(dense.export_buffers()).borrowed != nullptr, "dense column is borrowed");
+    compare("dense", dense);
+    roundTrip("dense", dense);
+    check(HybridSparseMultiVec<int, double>::import_buffers(dense.export_buffers()).column<0>().is_dense(),
+          "dense column comes back dense");
+    
+    dense.erase(begin(dense));
+    check(get<0>(dense.export_buffers()).borrowed != nullptr, "dense column is still borrowed");
+    compare("dense after erase", dense);
+    roundTrip("dense after erase", dense);
+    
+    if (failures == 0) cout << "ok" << endl;
+    return failures == 0? 0 : 1;
+}